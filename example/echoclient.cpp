@@ -35,7 +35,7 @@ class BusinessTester {
     protected:
     void OnMessageRecvd(TcpConnection* conn, const Message* msg)
     {
-        printf("[OnMessageRecvd] received message, fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[OnMessageRecvd] received message, fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         if (!strncmp(msg->Payload(), "reconnect request", msg->PayloadSize()))
         {
             EV_Singleton->StopLoop();
@@ -58,7 +58,7 @@ class BusinessTester {
     }
     void OnMessageRecvd_ip6(TcpConnection* conn, const Message* msg)
     {
-        printf("[OnMessageRecvd_ip6] received message, fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[OnMessageRecvd_ip6] received message, fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
     }
 
     void OnSendingTimer(TimerEvent* timer)
@@ -84,13 +84,13 @@ class BusinessTester {
     }
     void OnMessageRecvd_1(TcpConnection* conn, const Message* msg)
     {
-        printf("[echoserver1] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[echoserver1] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         //conn->Send(msg->Payload(), msg->PayloadSize());
         conn->Send(*msg);
     }
     void OnMessageRecvd_2(TcpConnection* conn, const Message* msg)
     {
-        printf("[echoserver2] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[echoserver2] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         if (!strncmp(msg->Payload(), "ping", msg->PayloadSize()))
           conn->Send("pong");
         else
@@ -99,7 +99,7 @@ class BusinessTester {
     }
     void OnMessageRecvd_ip6(TcpConnection* conn, const Message* msg)
     {
-        printf("[echoserver_ip6] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[echoserver_ip6] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         //conn->Send(msg->Payload(), msg->PayloadSize());
         conn->Send(*msg);
     }
@@ -109,7 +109,7 @@ class BusinessTester {
     }
     void OnMessageRecvd_Client(TcpConnection* conn, const Message* msg)
     {
-        printf("[echoclient] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[echoclient] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
     }
 
     private:
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "el.h"
+
+namespace evt_loop {
+
+class GroupServerTest {
+    public:
+    GroupServerTest(EventLoopGroup* loop_group, const char* io_mode, bool pin, bool reuseport, bool view) :
+      loop_group_(loop_group), echoserver_crlf_("0.0.0.0", 10011, MessageType::CRLF)
+    {
+        TcpCallbacksPtr echo_svr_cbs = std::shared_ptr<TcpCallbacks>(new TcpCallbacks);
+        echo_svr_cbs->on_msg_recvd_cb = std::bind(&GroupServerTest::OnMessageRecvd, this, std::placeholders::_1, std::placeholders::_2);
+        if (view) echo_svr_cbs->on_msg_view_recvd_cb = std::bind(&GroupServerTest::OnMessageViewRecvd, this, std::placeholders::_1, std::placeholders::_2);
+        echoserver_crlf_.SetTcpCallbacks(echo_svr_cbs);
+        echoserver_crlf_.SetNewClientCallback(std::bind(&GroupServerTest::OnNewConnection, this, std::placeholders::_1));
+        echoserver_crlf_.EnableIdleTimeout(10, std::bind(&GroupServerTest::OnConnectionIdleTimeout, this, std::placeholders::_1, std::placeholders::_2));
+        echoserver_crlf_.SetEventLoopGroup(loop_group);
+        echoserver_crlf_.SetName("echoserver_crlf");
+        if (!strcmp(io_mode, "completion")) echoserver_crlf_.EnableCompletionMode();
+        if (!strcmp(io_mode, "edge")) echoserver_crlf_.EnableEdgeTriggered();
+        if (pin) echoserver_crlf_.EnableIncomingCpu();
+        if (reuseport) echoserver_crlf_.EnableReusePort(pin);
+    }
+    void OnSignal(SignalHandler* sh, uint32_t signo)
+    {
+        printf("Shutdown, connections: %u\n", echoserver_crlf_.GetConnectionNumber());
+        LoopStats total;
+        for (uint32_t i = 0; i < loop_group_->Size(); ++i) {
+            EventLoopThread* t = loop_group_->GetThread(i);
+            LoopStats stats;
+            std::vector<HandlerStats> handlers;
+            t->PostAndWait([&]() {
+                t->GetLoop()->GetStats(stats);
+                if (t->GetLoop()->GetProfiler()) t->GetLoop()->GetProfiler()->GetHandlerStats(handlers);
+            });
+            total.Merge(stats);
+            for (size_t j = 0; j < handlers.size(); ++j) {
+                printf("Loop %u handler: %s, calls: %lu, slow calls: %lu, time: %.3fms, cpu: %.3fms, max: %.3fms\n",
+                        i, handlers[j].name.c_str(), handlers[j].calls, handlers[j].slow_calls,
+                        handlers[j].wall_ns / 1e6, handlers[j].cpu_ns / 1e6, handlers[j].max_ns / 1e6);
+            }
+        }
+        printf("Loop group stats:\n%s", total.ToString().c_str());
+        AcceptStats accept_stats;
+        echoserver_crlf_.GetAcceptStats(accept_stats);
+        printf("Accept stats: accepted: %lu, wakeups: %lu (%.2f per wakeup), full batches: %lu, errors: %lu, max batch: %u\n",
+                accept_stats.accepted, accept_stats.wakeups, accept_stats.AcceptedPerWakeup(),
+                accept_stats.full_batches, accept_stats.errors, accept_stats.max_batch);
+        printf("Admission: rejected by max connections: %lu, per ip: %lu, rate: %lu, shed pauses: %lu (%.3fms)\n",
+                accept_stats.rejected[AcceptStats::MAX_CONNECTIONS], accept_stats.rejected[AcceptStats::MAX_PER_IP],
+                accept_stats.rejected[AcceptStats::ACCEPT_RATE], accept_stats.shed_pauses, accept_stats.shed_ns / 1e6);
+        EV_Singleton->StopLoop();
+    }
+
+    private:
+    void OnNewConnection(TcpConnection* conn)
+    {
+        EventLoopThread* t = EventLoopThread::Current();
+        printf("[GroupServerTest::OnNewConnection] fd: %d, loop thread: %d\n", conn->FD(), t ? (int)t->Index() : -1);
+    }
+    void OnMessageRecvd(TcpConnection* conn, const Message* msg)
+    {
+        EventLoopThread* t = EventLoopThread::Current();
+        printf("[GroupServerTest::OnMessageRecvd] fd: %d, loop thread: %d, message: %.*s, length: %lu\n",
+                conn->FD(), t ? (int)t->Index() : -1, (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
+        conn->Send(*msg);
+    }
+    void OnMessageViewRecvd(TcpConnection* conn, const MessageView& view)
+    {
+        EventLoopThread* t = EventLoopThread::Current();
+        printf("[GroupServerTest::OnMessageViewRecvd] fd: %d, loop thread: %d, message: %.*s, length: %lu\n",
+                conn->FD(), t ? (int)t->Index() : -1, (int)view.PayloadSize(), view.Payload(), view.PayloadSize());
+        // the reply references the blocks received, no copying
+        conn->Send(view.GetMessage());
+    }
+    void OnConnectionIdleTimeout(TcpConnection* conn, uint32_t time)
+    {
+        printf("[GroupServerTest::OnConnectionIdleTimeout] fd: %d, idle time: %u\n", conn->FD(), time);
+        conn->Disconnect();
+    }
+
+    private:
+    EventLoopGroup* loop_group_;
+    TcpServer echoserver_crlf_;
+};
+
+}  // ns evt_loop
+
+using namespace evt_loop;
+
+int main(int argc, char **argv) {
+  uint32_t threads = argc > 1 ? atoi(argv[1]) : 4;
+  EventLoopGroup::Policy policy = (argc > 2 && !strcmp(argv[2], "lc")) ?
+      EventLoopGroup::LEAST_CONNECTIONS : EventLoopGroup::ROUND_ROBIN;
+  const char* io_mode = argc > 3 ? argv[3] : "level";  // level, edge or completion
+  uint32_t slow_ms = argc > 4 ? atoi(argv[4]) : 0;      // profiles the callbacks if it is set
+  uint32_t spin_us = argc > 5 ? atoi(argv[5]) : 0;      // busy polls if it is set
+  const char* options = argc > 6 ? argv[6] : "";
+  bool pin = strstr(options, "pin") != NULL;              // pins the loops to the cpus in turn
+  bool reuseport = strstr(options, "reuseport") != NULL;  // a listener per loop
+  bool view = strstr(options, "view") != NULL;            // the messages are delivered as views
+
+  EventLoopGroup loop_group(threads, policy);
+  if (pin) {
+      std::vector<int> cpus;
+      for (long i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); ++i) cpus.push_back(i);
+      loop_group.SetCpuAffinity(cpus);
+  }
+  loop_group.Start();
+  for (uint32_t i = 0; slow_ms > 0 && i < loop_group.Size(); ++i) {
+      EventLoopThread* t = loop_group.GetThread(i);
+      t->PostAndWait([&]() { t->GetLoop()->EnableProfiler(TimeVal(slow_ms / 1000, slow_ms % 1000 * 1000)); });
+  }
+  for (uint32_t i = 0; spin_us > 0 && i < loop_group.Size(); ++i) {
+      EventLoopThread* t = loop_group.GetThread(i);
+      t->PostAndWait([&]() { t->GetLoop()->EnableBusyPoll(TimeVal(spin_us / 1000000, spin_us % 1000000), 50); });
+  }
+
+  GroupServerTest server(&loop_group, io_mode, pin, reuseport, view);
+  SignalHandler sh(SignalEvent::INT, std::bind(&GroupServerTest::OnSignal, &server, std::placeholders::_1, std::placeholders::_2));
+
+  EV_Singleton->StartLoop();
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "el.h"
+
+// counts the heap allocations, the operator new of the library calls malloc() too.
+// the allocator of glibc is called by its internal names.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void  __libc_free(void* ptr);
+
+static size_t g_mallocs = 0;
+
+extern "C" void* malloc(size_t size)
+{
+    g_mallocs++;
+    return __libc_malloc(size);
+}
+
+extern "C" void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+namespace evt_loop {
+
+static int64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the path of the messages sent, created from the data, queued and released once written
+static void SendMessages(size_t count, size_t batch)
+{
+    static const char line[] = "hello, message pool\r\n";
+    MessageMQ tx_mq;
+    for (size_t i = 0; i < count; i += batch) {
+        for (size_t j = 0; j < batch; ++j) {
+            tx_mq.Push(CreateMessage(MessageType::CRLF, line, sizeof(line) - 1));
+        }
+        while (!tx_mq.Empty()) tx_mq.EraseFirst();
+    }
+}
+
+// the path of the messages received, split from the receive buffer and dispatched
+static void ReceiveMessages(size_t count, size_t batch, const Buffer& rx_data)
+{
+    size_t received = 0;
+    MessageMQ rx_mq;
+    rx_mq.SetMessageType(MessageType::CRLF);
+    MessageMQ::MessageDispatcher cb = [&received](const Message* msg) { received++; };
+    for (size_t i = 0; i < count; i += batch) {
+        Buffer rx_buf(rx_data);     // references the blocks, no copying
+        rx_mq.AppendData(rx_buf);
+        rx_mq.Apply(cb);
+    }
+    if (received != count) fprintf(stderr, "received %lu messages of %lu\n", received, count);
+}
+
+static void Run(const char* name, size_t count, size_t batch, const Buffer& rx_data)
+{
+    SendMessages(batch, batch);     // warm up the pool
+    size_t mallocs = g_mallocs;
+    int64_t begin = NowNs();
+    SendMessages(count, batch);
+    int64_t send_ns = NowNs() - begin;
+    size_t send_mallocs = g_mallocs - mallocs;
+
+    ReceiveMessages(batch, batch, rx_data);
+    mallocs = g_mallocs;
+    begin = NowNs();
+    ReceiveMessages(count, batch, rx_data);
+    int64_t recv_ns = NowNs() - begin;
+    size_t recv_mallocs = g_mallocs - mallocs;
+
+    fprintf(stderr, "%-8s send: %.2f allocs/msg, %.1f ns/msg   receive: %.2f allocs/msg, %.1f ns/msg\n", name,
+            (double)send_mallocs / count, (double)send_ns / count,
+            (double)recv_mallocs / count, (double)recv_ns / count);
+}
+
+}  // namespace evt_loop
+
+using namespace evt_loop;
+
+// usage: message_pool_bench [messages] [batch] > /dev/null
+// the results are printed to stderr, the stdout takes the logging of the library
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t batch = argc > 2 ? atol(argv[2]) : 64;
+    if (batch == 0) batch = 1;
+    count = (count + batch - 1) / batch * batch;
+
+    // a read of batch lines, received once and split each round
+    Buffer rx_data(64 * 1024);
+    for (size_t i = 0; i < batch; ++i) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "message %lu of the batch\r\n", i);
+        rx_data.Append(line, n);
+    }
+
+    fprintf(stderr, "%lu messages, %lu in a batch\n", count, batch);
+    SetMessagePoolLimit(0);
+    Run("no pool", count, batch, rx_data);
+    SetMessagePoolLimit(1024);
+    Run("pool", count, batch, rx_data);
+    return 0;
+}
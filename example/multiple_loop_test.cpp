@@ -33,7 +33,7 @@ class ClientThreadTest {
     }
     void OnMessageRecvd_Client(TcpConnection* conn, const Message* msg)
     {
-        printf("[ClientThreadTest] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[ClientThreadTest] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
     }
 
     private:
@@ -65,7 +65,7 @@ class ServerThreadTest {
     }
     void OnMessageRecvd_Server(TcpConnection* conn, const Message* msg)
     {
-        printf("[ServerThreadTest::OnMessageRecvd_Server] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[ServerThreadTest::OnMessageRecvd_Server] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         conn->Send(*msg);
     }
 
@@ -1,6 +1,7 @@
 #ifndef _CDB_REDIS_H
 #define _CDB_REDIS_H
 
+#include <queue>
 #include <async.h>
 #include <hiredis.h>
 #include "cdb_client.h"
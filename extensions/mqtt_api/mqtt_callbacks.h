@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <functional>
 #include <memory>
+#include <queue>
 
 namespace mqtt_api {
 
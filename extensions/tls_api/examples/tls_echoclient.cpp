@@ -32,7 +32,7 @@ class BusinessTester {
     protected:
     void OnMessageRecvd(TcpConnection* conn, const Message* msg)
     {
-        printf("[OnMessageRecvd] received message, fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[OnMessageRecvd] received message, fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         if (!strncmp(msg->Payload(), "reconnect request", msg->PayloadSize()))
         {
             EV_Singleton->StopLoop();
@@ -43,13 +43,13 @@ class BusinessTester {
     }
     void OnMessageRecvd_1(TcpConnection* conn, const Message* msg)
     {
-        printf("[echoserver1] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[echoserver1] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
         //conn->Send(msg->Payload(), msg->PayloadSize());
         conn->Send(*msg);
     }
     void OnMessageRecvd_Client(TcpConnection* conn, const Message* msg)
     {
-        printf("[echoclient] fd: %d, message: %s, length: %lu\n", conn->FD(), msg->Payload(), msg->PayloadSize());
+        printf("[echoclient] fd: %d, message: %.*s, length: %lu\n", conn->FD(), (int)msg->PayloadSize(), msg->Payload(), msg->PayloadSize());
     }
 
     private:
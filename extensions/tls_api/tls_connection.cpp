@@ -1,4 +1,5 @@
 #include "tls_connection.h"
+#include "eventloop.h"
 
 using namespace std;
 
@@ -50,7 +51,8 @@ void TLSConnection::setSSLCertKey(const char* cert, const char* key, const char*
 
 TLSConnection::TLSConnection(int fd, const IPAddress& local_addr, const IPAddress& peer_addr, const IPAddress& peer_real_addr,
             const OnClosedCallback& close_cb, TcpCallbacksPtr tcp_evt_cbs) :
-    TcpConnection(fd, local_addr, peer_addr, peer_real_addr, close_cb, tcp_evt_cbs), ssl_(NULL)
+    TcpConnection(fd, local_addr, peer_addr, peer_real_addr, close_cb, tcp_evt_cbs), ssl_(NULL),
+    rx_end_pending_(false), rx_end_(0), rx_end_errno_(0)
 {
     safeSSLInit();
 }
@@ -127,6 +129,40 @@ int TLSConnection::OnRead(const void* buf, size_t bytes)
     return rd;
 }
 
+// SSL_read returns a record at most, so it is called until the buffers are filled or the data
+// runs out, a short read means both the socket and the SSL buffers are drained as for readv().
+// the end of the stream or an error after some data is returned by the next call, the fd may
+// not be reported again, so the connection is marked ready for it.
+int TLSConnection::OnReadv(const struct iovec* iov, int iovcnt)
+{
+    if (rx_end_pending_) {
+        rx_end_pending_ = false;
+        errno = rx_end_errno_;
+        return rx_end_;
+    }
+    int total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        size_t got = 0;
+        while (got < iov[i].iov_len) {
+            int rd = OnRead((char*)iov[i].iov_base + got, iov[i].iov_len - got);
+            if (rd <= 0) {
+                if (total == 0) return rd;
+                int ssle = SSL_get_error(ssl_, rd);
+                if (ssle != SSL_ERROR_WANT_READ && ssle != SSL_ERROR_WANT_WRITE) {
+                    rx_end_pending_ = true;
+                    rx_end_ = rd;
+                    rx_end_errno_ = errno;
+                    if (el_) el_->MarkReady(this, FileEvent::READ);
+                }
+                return total;
+            }
+            got += rd;
+            total += rd;
+        }
+    }
+    return total;
+}
+
 int TLSConnection::OnWrite(const void* buf, size_t bytes)
 {
     printf("[TLSConnection::OnWrite]\n");
@@ -140,4 +176,39 @@ int TLSConnection::OnWrite(const void* buf, size_t bytes)
     return wd;
 }
 
+// the pack holds the first bytes of the buffers given, it is dropped if they changed
+static bool PackMatches(const std::string& pack, const struct iovec* iov, int iovcnt)
+{
+    size_t off = 0;
+    for (int i = 0; i < iovcnt && off < pack.size(); ++i) {
+        size_t len = std::min(iov[i].iov_len, pack.size() - off);
+        if (memcmp(pack.data() + off, iov[i].iov_base, len) != 0) return false;
+        off += len;
+    }
+    return off == pack.size();
+}
+
+// the messages are packed into one SSL_write instead of a record each. SSL_write must be
+// retried with the same bytes after SSL_ERROR_WANT_WRITE, so the pack is kept until it is
+// written, the messages sent are not taken from the queue before that.
+int TLSConnection::OnWritev(const struct iovec* iov, int iovcnt)
+{
+    if (!tx_pack_.empty() && !PackMatches(tx_pack_, iov, iovcnt)) {
+        printf("[TLSConnection::OnWritev] fd: %d, the pack is not the head of the queue, dropped\n", fd_);
+        tx_pack_.clear();
+    }
+    if (tx_pack_.empty()) {
+        for (int i = 0; i < iovcnt && tx_pack_.size() < MAX_PACK_BYTES; ++i) {
+            size_t len = std::min(iov[i].iov_len, MAX_PACK_BYTES - tx_pack_.size());
+            tx_pack_.append((const char*)iov[i].iov_base, len);
+        }
+        if (tx_pack_.empty()) return 0;
+    }
+    int wd = OnWrite(tx_pack_.data(), tx_pack_.size());
+    if (wd > 0) {
+        tx_pack_.erase(0, wd);
+    }
+    return wd;
+}
+
 };
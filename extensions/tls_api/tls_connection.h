@@ -17,10 +17,19 @@ struct TLSConnection : public TcpConnection
   protected:
   virtual bool OnHandshake();
   virtual int OnRead(const void* buf, size_t bytes);
+  virtual int OnReadv(const struct iovec* iov, int iovcnt);
   virtual int OnWrite(const void* buf, size_t bytes);
+  virtual int OnWritev(const struct iovec* iov, int iovcnt);
+  virtual void OnTxCleared() { tx_pack_.clear(); }
 
   private:
+  static const size_t MAX_PACK_BYTES = 16384;   // the plaintext of a TLS record
+
   SSL *ssl_;
+  bool rx_end_pending_;   // the end of the stream or an error read after some data, see OnReadv()
+  int  rx_end_;
+  int  rx_end_errno_;
+  std::string tx_pack_;   // the messages packed for SSL_write, kept until it is written
 };
 
 };
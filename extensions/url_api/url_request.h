@@ -2,6 +2,7 @@
 #define _URL_REQUEST_H
 
 #include <map>
+#include <queue>
 #include <curl/curl.h>
 #include "fd_handler.h"
 #include "el.h"
@@ -0,0 +1,126 @@
+#ifndef _BUFFER_H
+#define _BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace evt_loop {
+
+// refcounted fixed-size block of memory, shared by the buffers referencing parts of it.
+// the bytes are written once, by the buffer holding the high-water mark, and only read
+// afterwards, so the buffers on different threads may share a block.
+class BufferBlock {
+  public:
+  // the high-water mark starts at used, the bytes before it are the headroom
+  static BufferBlock* Create(uint32_t capacity, uint32_t used = 0);
+
+  void Ref()              { refs_.fetch_add(1, std::memory_order_relaxed); }
+  void Unref()            { if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) Destroy(); }
+  bool Exclusive() const  { return refs_.load(std::memory_order_acquire) == 1; }
+
+  char* Data()              { return data_; }
+  uint32_t Capacity() const { return capacity_; }
+  uint32_t Available(uint32_t end) const { return end < capacity_ ? capacity_ - end : 0; }
+  // claims [end, end + n) for writing, it succeeds if end is the high-water mark only
+  bool Extend(uint32_t end, uint32_t n);
+  // gives [end, claimed) back, claimed by Extend() and not written
+  void Unclaim(uint32_t end, uint32_t claimed);
+  // empties the block to write it again, it must not be shared
+  void Reset(uint32_t used) { used_.store(used, std::memory_order_relaxed); }
+
+  private:
+  BufferBlock(uint32_t capacity, uint32_t used) : refs_(1), used_(used), capacity_(capacity) { }
+  void Destroy();
+
+  private:
+  std::atomic<uint32_t> refs_;
+  std::atomic<uint32_t> used_;
+  uint32_t              capacity_;
+  alignas(16) char      data_[0];
+};
+
+// chain of slices of refcounted blocks, used for the buffers of a connection and the data
+// of the messages. appending fills the last block and chains new ones, so the data is
+// never moved to grow, and a part of the buffer is taken by referencing its blocks.
+// it is not thread-safe, but the blocks may be shared by the buffers on other threads.
+class Buffer {
+  public:
+  static const uint32_t DFT_BLOCK_SIZE = 4096;
+  static const uint32_t HEADROOM = 16;    // reserved in the first block for Prepend()
+
+  public:
+  explicit Buffer(uint32_t block_size = DFT_BLOCK_SIZE);
+  Buffer(const Buffer& other);            // shares the blocks
+  Buffer& operator=(const Buffer& other);
+  ~Buffer();
+
+  void SetBlockSize(uint32_t block_size) { block_size_ = block_size; }
+  uint32_t BlockSize() const { return block_size_; }
+
+  size_t Size() const   { return size_; }
+  bool Empty() const    { return size_ == 0; }
+  bool Contiguous() const;
+  // the first byte, all of the data if it is contiguous. NULL if it is empty
+  const char* Data() const;
+  char At(size_t pos) const;
+  size_t CopyOut(char* dst, size_t pos, size_t len) const;
+
+  // the contiguous segments of the data, in order
+  size_t SegmentCount() const { return count_; }
+  const char* Segment(size_t i, size_t* len) const;
+
+  // copies the data to the end
+  void Append(const char* data, size_t len);
+  // references the data of the other buffer
+  void Append(const Buffer& other);
+  // copies the data to the front, into the headroom if the first block is not shared
+  void Prepend(const char* data, size_t len);
+  // the space after the data to receive into in place, the rest of the last block, or a new
+  // block if it is full. it is reserved for the buffer until Commit().
+  char* Prepare(size_t* len);
+  // takes the first len bytes written into the space of Prepare() as data
+  void Commit(size_t len);
+
+  // references len bytes from pos into dst
+  void Slice(size_t pos, size_t len, Buffer& dst) const;
+  // moves the first len bytes to the end of dst, the blocks are referenced instead of copied
+  void MoveTo(Buffer& dst, size_t len);
+  // drops the first len bytes. the last block is kept if it is emptied, to be appended to
+  void Consume(size_t len);
+
+  // copies the data into a single block if it spans more than one
+  void Linearize();
+  // copies the data into a block of its own if any block is shared, before writing into it
+  void Unshare();
+  void Clear();
+  // drops the data like Clear(), the last block is kept to be appended to again if it is not
+  // shared and not larger than max_capacity, so a buffer reused does not allocate
+  void Recycle(uint32_t max_capacity);
+
+  private:
+  struct Span {
+    BufferBlock* block;
+    uint32_t     begin;
+    uint32_t     end;
+  };
+  static const uint32_t INLINE_SLICES = 2;
+
+  void PushBack(const Span& slice);    // takes the reference of the block
+  void PushFront(const Span& slice);
+  void PopFront();
+  void Reserve(uint32_t n);
+  void CopyInto(uint32_t headroom);
+
+  private:
+  Span*     slices_;
+  uint32_t  count_;
+  uint32_t  capacity_;
+  uint32_t  block_size_;
+  size_t    size_;
+  uint32_t  prepared_;    // the end of the space reserved by Prepare()
+  Span      inline_[INLINE_SLICES];   // the slices of a short chain, no allocation
+};
+
+}  // evt_loop
+#endif  // _BUFFER_H
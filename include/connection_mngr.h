@@ -31,7 +31,7 @@ typedef std::map<time_t, CID_CONN_CTX_MAP>          TIME_CONN_MAP_MAP;
 class ConnectionManager
 {
     public:
-    ConnectionManager(const ConnectionIdleTimeoutCallback& timeout_cb, uint32_t timeout = 0);
+    ConnectionManager(const ConnectionIdleTimeoutCallback& timeout_cb, uint32_t timeout = 0, EventLoop* el = NULL);
     bool TimeoutCheckingEnabled() const { return m_timeout != 0; }
     void SetupInactivityChecker(uint32_t timeout);
     CM_ENUM CheckConnectionExists(ClientID cid, TcpConnection* conn);
@@ -2,6 +2,7 @@
 #define _EL_H
 
 #include "eventloop.h"
+#include "eventloop_group.h"
 #include "tcp_client.h"
 #include "tcp_server.h"
 #include "timer_handler.h"
@@ -14,16 +14,24 @@ class IEvent {
   static const uint32_t  NONE = 0;
 
  public:
-  IEvent(uint32_t events = 0, EventLoop* el = NULL) : events_(events), el_(el) { }
+  IEvent(uint32_t events = 0, EventLoop* el = NULL) : events_(events), el_(el), name_(NULL) { }
   virtual ~IEvent() { events_ = 0; el_ = NULL; };
 
   virtual void OnEvents(uint32_t events) = 0;
   virtual void SetEvents(uint32_t events) { events_ = events; }
   virtual uint32_t Events() const { return events_; }
+  // the loop the event is bound to, NULL if an IOEvent is not registered yet
+  EventLoop* GetLoop() const { return el_; }
+
+  // name of the handler in the profiler of the loop, the type name of the event if NULL.
+  // it must be of static storage, e.g. a string literal.
+  void SetName(const char* name) { name_ = name; }
+  const char* Name() const { return name_; }
 
  protected:
   uint32_t events_;
   EventLoop *el_;
+  const char* name_;
 };
 
 }  // namespace evt_loop
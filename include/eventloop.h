@@ -1,9 +1,16 @@
 #ifndef _EVENT_LOOP_H
 #define _EVENT_LOOP_H
 
+#include <pthread.h>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <vector>
 #include "utils.h"
 #include "poller.h"
+#include "mpsc_queue.h"
+#include "loop_stats.h"
+#include "fd_table.h"
 
 namespace evt_loop {
 
@@ -11,16 +18,23 @@ class IOEvent;
 class BufferIOEvent;
 class TimerManager;
 class SignalEvent;
+class SignalManager;
 class TimerEvent;
 class PeriodicTimerEvent;
 class IdleEvent;
 class TickEvent;
 class UserEventManager;
+class LoopWaker;
+class LoopTimer;
+
+typedef std::function<void ()> Functor;
 
 time_t Now();
 int SetNonblocking(int fd);
 
 class EventLoop {
+  static const int MAX_WAIT_MS = 100;   // the longest time blocked in the poller
+
  public:
   EventLoop();
   ~EventLoop();
@@ -30,6 +44,16 @@ class EventLoop {
   int AddEvent(IOEvent *e);
   int DeleteEvent(IOEvent *e);
   int UpdateEvent(IOEvent *e);
+  // lets the poller receive or accept on the fd of the added event, the results are
+  // passed to IOEvent::OnCompletion(). returns -1 if the poller does not support it.
+  int EnableCompletion(IOEvent *e, PollerCompletion type);
+  // queues the events to be delivered to the event again in the next loop iteration,
+  // without waiting for the poller. for the work left by an I/O budget in edge-triggered mode.
+  void MarkReady(IOEvent *e, uint32_t events);
+  // keeps the object, e.g. a closed connection, alive until the I/O handlers of the loop
+  // iteration return, then releases it with the others in a batch. so an event released by
+  // its own callback is not destroyed in the middle of the callback. on the loop thread only.
+  void DeferRelease(const std::shared_ptr<void>& obj) { graveyard_.push_back(obj); }
 
   int AddEvent(TimerEvent *e);
   int DeleteEvent(TimerEvent *e);
@@ -51,27 +75,128 @@ class EventLoop {
   void StartLoop();
   void StopLoop();
 
+  // runs the functor at once if called on the loop thread, otherwise queues it
+  void RunInLoop(const Functor& fn);
+  // queues the functor to be run on the loop thread in the next loop iteration,
+  // it is safe to be called from any thread and wakes up the loop if it is waiting.
+  void QueueInLoop(const Functor& fn);
+  bool IsInLoopThread() const { return pthread_equal(tid_, pthread_self()); }
+
   bool IsRunning() const { return running_; }
+
+  // the loop of the caller thread: the one running on it, or set by SetCurrent(), otherwise
+  // EV_Singleton. the events, timers and connections created without a loop are bound to it.
+  static EventLoop* Current();
+  // binds the objects created by the caller thread from now on to the loop, NULL to reset.
+  // e.g. to build the objects on one thread and run them on a loop of another thread.
+  static void SetCurrent(EventLoop* loop);
+  const Poller* GetPoller() const { return poller_.get(); }
+  // the monotonic time of the current loop iteration, for the timers
   const TimeVal& Now() const { return now_; }
-  time_t UnixTime() const { return now_.Seconds(); }
+  // the wall clock time of the current loop iteration
+  time_t UnixTime() const { return unix_time_; }
+
+  // per-phase latency histograms, wait and busy time and loop lag of the iterations.
+  // enabled by default, it costs a few clock reads per iteration.
+  void EnableStats(bool enable) { stats_enabled_ = enable; }
+  bool StatsEnabled() const { return stats_enabled_; }
+  // copies the statistics collected so far, it must be called on the loop thread,
+  // see RunInLoop() and EventLoopThread::PostAndWait()
+  void GetStats(LoopStats& stats) const { stats = stats_; }
+  void ResetStats() { stats_.Reset(); }
+
+  // measures every callback dispatched by the loop: the handlers of the fds, timers, idle and
+  // tick events and the tasks, and attributes the time to the handlers, see IEvent::SetName().
+  // the calls took the threshold or longer are reported to the callback, or printed if it is
+  // empty. it costs a branch per callback when disabled.
+  void EnableProfiler(const TimeVal& threshold, const CallbackProfiler::OnSlowCallback& cb = nullptr);
+  void DisableProfiler() { profiling_ = false; }
+  // the profiler if it is enabled, otherwise NULL, for the managers dispatching the events
+  CallbackProfiler* ActiveProfiler() const { return profiling_ ? profiler_ : NULL; }
+  // the counters collected, NULL if the profiler was never enabled. use it on the loop thread
+  const CallbackProfiler* GetProfiler() const { return profiler_; }
+
+  // spins in the poller with timeout 0 for a window after the last events before blocking,
+  // for the lowest latency at the cost of cpu. the window adapts to the traffic between
+  // max_spin/16 and max_spin: doubled when a spinning poll finds events, halved when it runs
+  // out without any. busy_poll_us sets SO_BUSY_POLL and SO_PREFER_BUSY_POLL on the connections
+  // created from now on, 0 to leave the sockets alone. the costs are counted in LoopStats.
+  void EnableBusyPoll(const TimeVal& max_spin, uint32_t busy_poll_us = 0);
+  void DisableBusyPoll() { spin_max_ns_ = 0; busy_poll_us_ = 0; }
+  bool BusyPolling() const { return spin_max_ns_ > 0; }
+  // sets the socket options of EnableBusyPoll() on the socket
+  void SetupBusyPoll(int fd);
+
+  // pins the loop thread to the cpu, it must be called on the loop thread. the buffers of the
+  // poller are moved to the NUMA node of the cpu, and the memory the thread allocates from now
+  // on is placed there by the first-touch policy. returns -1 on failure.
+  int SetCpuAffinity(int cpu);
+  // the cpu pinned to and its NUMA node, -1 if the loop is not pinned
+  int Cpu() const { return cpu_; }
+  int NumaNode() const { return numa_node_; }
 
  private:
   // do epoll_waite and collect events
-  int ProcessEvents(int timeout);
+  int ProcessEvents();
 
   int ProcessFileEvents(int timeout);
+  int ProcessReadyEvents();
   int ProcessTimeoutEvents();
   int ProcessIdleEvents();
   int ProcessTickEvents();
+  int ProcessPendingTasks();
   void _ProcessFileEvents(void* evt, uint32_t events);
+  void _ProcessCompletion(void* evt, int res, const char* data);
+
+  // the handle of the registered IOEvent passed to the poller, see io_events_
+  void* Register(IOEvent* e);
+  // the handle of the event registered already, NULL if it is not
+  void* Handle(IOEvent* e) const;
+  IOEvent* Resolve(void* handle);
 
+  void ReleaseGraveyard();
   int CalcNextTimeout();
+  void Wakeup();
+  TimeVal EndPhase(int phase, const TimeVal& begin, int events);
 
  private:
   std::shared_ptr<Poller>   poller_;
+  std::vector<IOEvent*>     ready_list_;  // see MarkReady(), the deleted events are NULL
+  // the registered IOEvents by fd. the poller gets a handle of the fd and the generation of its
+  // slot rather than the pointer, so the events of an IOEvent deleted by a handler earlier in
+  // the same batch are dropped instead of dispatched to freed memory.
+  FdTable<IOEvent*>         io_events_;
+  std::vector<std::shared_ptr<void>> graveyard_;  // see DeferRelease()
 
   TimeVal   now_;
-  bool      running_;
+  time_t    unix_time_;
+  std::atomic<bool> running_;
+  pthread_t tid_;   // the thread runs the loop
+
+  MpscQueue<Functor>  pending_tasks_;
+  std::atomic<bool>   wakeup_pending_;
+  LoopWaker*          waker_;
+  LoopTimer*          timer_;   // wakes up the poller at the next expiration, NULL if not supported
+  SignalManager*      signal_manager_;  // created for the first SignalEvent
+
+  bool      stats_enabled_;
+  bool      woken_;         // a handler was called in the poller, now_ is the time of the wake up
+  int       internal_events_;   // of the timerfd and the waker in the poller, see ProcessEvents()
+  bool      lag_pending_;   // the loop is to wake up at lag_expires_
+  TimeVal   lag_expires_;
+  LoopStats stats_;
+  bool      profiling_;
+  CallbackProfiler* profiler_;
+
+  int64_t   spin_max_ns_;     // 0 if busy polling is disabled
+  int64_t   spin_window_ns_;
+  bool      spin_armed_;      // spinning until spin_deadline_
+  TimeVal   spin_deadline_;
+  uint32_t  busy_poll_us_;
+  bool      busy_poll_warned_;
+
+  int       cpu_;
+  int       numa_node_;
 
   std::shared_ptr<TimerManager> timermanager_;
   std::shared_ptr<UserEventManager> idle_events_;
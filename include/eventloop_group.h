@@ -0,0 +1,107 @@
+#ifndef _EVENT_LOOP_GROUP_H
+#define _EVENT_LOOP_GROUP_H
+
+#include <pthread.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include "eventloop.h"
+
+namespace evt_loop {
+
+// a thread running its own EventLoop, other threads talk to it by posting tasks.
+// the loop is owned by the thread and is EventLoop::Current() of it, so every event created
+// by the tasks (connections, timers ...) is registered to and processed by this loop only.
+class EventLoopThread {
+ public:
+  EventLoopThread(uint32_t index);
+  ~EventLoopThread();
+
+  bool Start();
+  void Stop();
+
+  uint32_t Index() const { return index_; }
+  // NULL if the thread is not running, the loop is freed when the thread exits
+  EventLoop* GetLoop() const { return loop_; }
+  bool IsRunning() const { return running_; }
+  bool InLoopThread() const { return running_ && pthread_equal(tid_, pthread_self()); }
+
+  // pins the thread to the cpu when it starts, before the loop is created, so the loop, its
+  // poller and the buffers allocated by the thread are on the NUMA node of the cpu.
+  // -1 not to pin, it takes effect on the next Start().
+  void SetCpu(int cpu) { cpu_ = cpu; }
+  int Cpu() const { return cpu_; }
+
+  // queues the task to be run on the loop thread, see EventLoop::QueueInLoop(). returns false
+  // and drops the task if the loop is not running. the tasks queued are run before the loop
+  // is freed.
+  bool Post(const Functor& task);
+  // runs the task on the loop thread and waits for it to finish
+  void PostAndWait(const Functor& task);
+
+  // number of connections owned by this loop, maintained by the dispatcher
+  uint32_t Load() const { return load_; }
+  void IncLoad() { ++load_; }
+  void DecLoad() { --load_; }
+
+  // the EventLoopThread of the caller, NULL if the caller is not a loop thread
+  static EventLoopThread* Current();
+
+ private:
+  static void* ThreadRoutine(void* arg);
+  void Run();
+
+ private:
+  uint32_t      index_;
+  pthread_t     tid_;
+  int           cpu_;
+  std::atomic<EventLoop*>  loop_;   // written under mutex_
+  std::atomic<bool>     running_;
+  std::atomic<uint32_t> load_;
+
+  std::mutex                mutex_;   // for Start() waiting the loop, and Post() racing with the exit
+  std::condition_variable   cond_;
+};
+
+// a fixed set of EventLoopThreads, a TcpServer accepts on its own loop and
+// distributes the new connections among them.
+class EventLoopGroup {
+ public:
+  enum Policy { ROUND_ROBIN, LEAST_CONNECTIONS };
+
+ public:
+  EventLoopGroup(uint32_t threads, Policy policy = ROUND_ROBIN);
+  ~EventLoopGroup();
+
+  bool Start();
+  void Stop();
+
+  uint32_t Size() const { return threads_.size(); }
+  EventLoopThread* GetThread(uint32_t index) const { return index < threads_.size() ? threads_[index] : NULL; }
+  bool Contains(const EventLoopThread* t) const { return t && GetThread(t->Index()) == t; }
+
+  Policy GetPolicy() const { return policy_; }
+  void SetPolicy(Policy policy) { policy_ = policy; }
+
+  // selects the loop for a new connection, NULL if the group has no running loop.
+  // it should be called on the acceptor loop only.
+  EventLoopThread* Next();
+
+  // pins the threads to the cpus in turn, thread i to cpus[i % cpus.size()], before Start().
+  // the cpus should be of the same NUMA node as the NIC queues steering the traffic to them.
+  void SetCpuAffinity(const std::vector<int>& cpus);
+  // the running thread pinned to the cpu, NULL if none
+  EventLoopThread* ForCpu(int cpu) const;
+
+ private:
+  Policy    policy_;
+  uint32_t  next_;
+  std::vector<EventLoopThread*> threads_;
+};
+typedef std::shared_ptr<EventLoopGroup> EventLoopGroupPtr;
+
+}  // ns evt_loop
+
+#endif // _EVENT_LOOP_GROUP_H
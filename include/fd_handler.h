@@ -8,6 +8,7 @@
 #include <string>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "event.h"
 #include "message.h"
 #include "poller.h"
@@ -24,7 +25,8 @@ class IOEvent : public IEvent {
   enum IOType { NONE, TCP_CLIENT, TCP_SERVER, TCP_CONNECTION, COUNT };
 
  public:
-  IOEvent(IOType type = IOType::NONE, int fd = -1, uint32_t events = FileEvent::READ | FileEvent::ERROR);
+  // the fd is registered to the loop given, or to EventLoop::Current() if it is NULL
+  IOEvent(IOType type = IOType::NONE, int fd = -1, uint32_t events = FileEvent::READ | FileEvent::ERROR, EventLoop* el = NULL);
   virtual ~IOEvent();
 
  public:
@@ -40,6 +42,9 @@ class IOEvent : public IEvent {
   void AddErrorEvent();
   void DeleteErrorEvent();
   void ClearAllEvents();
+  // the poller reports the events once per change of readiness, see FileEvent::EDGE
+  void SetEdgeTriggered(bool enable);
+  bool EdgeTriggered() const { return events_ & FileEvent::EDGE; }
 
  protected:
   virtual void OnCreated(int fd) {};
@@ -47,21 +52,39 @@ class IOEvent : public IEvent {
   virtual void OnError(int errcode, const char* errstr) {};
 
   virtual void OnEvents(uint32_t events) = 0;
+  // result of the receiving or accepting done by the poller in completion mode,
+  // see EventLoop::EnableCompletion(). the data is valid during the call only.
+  virtual void OnCompletion(int res, const char* data) { }
   virtual int OnRead(const void* buf, size_t bytes) { return read(fd_, (void*)buf, bytes); }
   virtual int OnWrite(const void* buf, size_t bytes) { return send(fd_, buf, bytes, MSG_NOSIGNAL); }
+  // reads into the buffers in order by one call, returns the bytes read like OnRead()
+  virtual int OnReadv(const struct iovec* iov, int iovcnt);
+  // writes the buffers in order by one call, returns the bytes written like OnWrite()
+  virtual int OnWritev(const struct iovec* iov, int iovcnt);
+  // the loop bound, or the current loop of the thread to register the fd to
+  EventLoop* Loop() const;
 
  protected:
   IOType type_;
   int fd_;
+
+ private:
+  uint32_t ready_events_;   // queued by EventLoop::MarkReady()
 };
 
 class BufferIOEvent : public IOEvent {
  public:
   enum State { CLOSED, CONNECTED, READY, HANDSHAKING, FAILED, COUNT };
+  static const uint32_t DFT_BUDGET_BYTES = 64 * 1024;
+  static const uint32_t DFT_BUDGET_MSGS  = 64;
+  // the range of the size of the blocks received into, see AdaptRxBlockSize()
+  static const uint32_t MIN_RX_BLOCK_SIZE = 1024;
+  static const uint32_t MAX_RX_BLOCK_SIZE = 64 * 1024;
 
  public:
-  BufferIOEvent(IOType io_type, int fd, uint32_t events = FileEvent::READ | FileEvent::WRITE | FileEvent::ERROR)
-    : IOEvent(io_type, fd, events), state_(CONNECTED), sent_(0), msg_seq_(0), close_wait_(false),
+  BufferIOEvent(IOType io_type, int fd, uint32_t events = FileEvent::READ | FileEvent::WRITE | FileEvent::ERROR, EventLoop* el = NULL)
+    : IOEvent(io_type, fd, events, el), state_(CONNECTED), sent_(0), msg_seq_(0), close_wait_(false),
+    completion_mode_(false), view_delivery_(false), rx_broken_(false), budget_bytes_(DFT_BUDGET_BYTES), budget_msgs_(DFT_BUDGET_MSGS),
     stats_rx_bytes_(0), stats_rx_last_time_(0), stats_tx_bytes_(0), stats_tx_last_time_(0) {
   }
   virtual ~BufferIOEvent() { state_ = CLOSED; }
@@ -70,10 +93,15 @@ class BufferIOEvent : public IOEvent {
 
   void SetMessageType(const MessageType& msg_type) {
     msg_type_ = msg_type;
+    rx_buf_.Clear();
+    rx_frame_.reset();
+    rx_broken_ = false;
     rx_msg_mq_.Clear();
     rx_msg_mq_.SetMessageType(msg_type_);
     tx_msg_mq_.Clear();
     tx_msg_mq_.SetMessageType(msg_type_);
+    sent_ = 0;
+    OnTxCleared();
   }
   MessageType GetMessageType() const { return msg_type_; }
   void ClearBuff();
@@ -84,6 +112,16 @@ class BufferIOEvent : public IOEvent {
   bool SendMore(const string& data);
   bool SendMore(const char *data, uint32_t len);
   void SetCloseWait() { close_wait_ = true; }
+  // receives by the poller into its buffers instead of reading on READ events,
+  // returns false if the poller does not support it.
+  bool EnableCompletionMode();
+  // parses the messages received by one Message reused instead of one allocated for each, and
+  // passes it to OnReceived() before the next one is parsed, so it is a view into the receive
+  // buffer valid during the call only. it is to be set before the data is received.
+  void EnableViewDelivery(bool enable) { view_delivery_ = enable; }
+  // limits the bytes received or sent and the messages dispatched in one wakeup, the rest is
+  // done in the next loop iteration so a busy peer can not starve the others. 0 means no limit.
+  void SetIOBudget(uint32_t bytes, uint32_t messages) { budget_bytes_ = bytes; budget_msgs_ = messages; }
 
   uint32_t StatsRxBytes() const     { return stats_rx_bytes_; };
   time_t   StatsRxLastTime() const  { return stats_rx_last_time_; };
@@ -94,12 +132,19 @@ class BufferIOEvent : public IOEvent {
   virtual void OnReceived(const Message* msg) { }
   virtual void OnSent(const Message* msg) { }
   virtual void OnReady() { }
+  // the messages queued to send are dropped, the data kept for them by a subclass is to be dropped too
+  virtual void OnTxCleared() { }
 
   virtual bool OnHandshake() { printf("BufferIOEvent::OnHandshake\n"); state_ = READY; OnReady(); return true; }
 
  private:
   void OnEvents(uint32_t events);
+  void OnCompletion(int res, const char* data);
   int ReceiveData(uint32_t& events);
+  void AdaptRxBlockSize(size_t rx_bytes);
+  bool DispatchMessages();
+  bool DispatchViews();
+  void OnBrokenMessage();
   int SendData(uint32_t& events);
   bool SendInner(const MessagePtr& msg);
 
@@ -111,11 +156,18 @@ class BufferIOEvent : public IOEvent {
 
  private:
   MessageType   msg_type_;
+  Buffer        rx_buf_;      // the bytes received, the messages received are views into it
   MessageMQ     rx_msg_mq_;
+  MessagePtr    rx_frame_;    // the message reused in the view delivery mode
   MessageMQ     tx_msg_mq_;
   uint32_t      sent_;
   uint32_t      msg_seq_;
   bool          close_wait_;
+  bool          completion_mode_;
+  bool          view_delivery_;
+  bool          rx_broken_;   // the data received is not a message of the type, see Message::Broken()
+  uint32_t      budget_bytes_;
+  uint32_t      budget_msgs_;
 
   uint32_t      stats_rx_bytes_;
   time_t        stats_rx_last_time_;
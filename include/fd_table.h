@@ -0,0 +1,109 @@
+#ifndef _FD_TABLE_H
+#define _FD_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+namespace evt_loop {
+
+// flat table of the values keyed by fd. the fds are small dense integers, so a lookup is
+// an index into the slots, and the values are kept packed in an array for the iteration.
+// each slot has a generation bumped when it is emptied, so a reference of the fd and the
+// generation tells the value from a later one reusing the fd.
+// it is not thread-safe, the table of a loop is used on the loop thread only.
+template<typename T>
+class FdTable
+{
+    static const uint32_t NPOS = (uint32_t)-1;
+
+    struct Slot {
+        uint32_t index;     // of the value in values_, NPOS if the slot is empty
+        uint32_t gen;
+
+        Slot() : index(NPOS), gen(0) { }
+    };
+
+    public:
+    // returns false if the fd is negative or taken
+    bool Insert(int fd, const T& value)
+    {
+        if (fd < 0) return false;
+        if ((size_t)fd >= slots_.size()) slots_.resize(fd + 1);
+        Slot& slot = slots_[fd];
+        if (slot.index != NPOS) return false;
+        slot.index = values_.size();
+        values_.push_back(value);
+        fds_.push_back(fd);
+        return true;
+    }
+
+    // NULL if the fd is not in the table, the pointer is valid until the table changes
+    T* Find(int fd)
+    {
+        if (fd < 0 || (size_t)fd >= slots_.size() || slots_[fd].index == NPOS) return NULL;
+        return &values_[slots_[fd].index];
+    }
+    const T* Find(int fd) const { return const_cast<FdTable*>(this)->Find(fd); }
+
+    // the last value is moved to the hole, so the values stay packed
+    bool Erase(int fd)
+    {
+        if (fd < 0 || (size_t)fd >= slots_.size() || slots_[fd].index == NPOS) return false;
+        Slot& slot = slots_[fd];
+        // released at the return, with the table consistent, its destructor may use the table
+        T value = std::move(values_[slot.index]);
+        uint32_t last = values_.size() - 1;
+        if (slot.index != last) {
+            values_[slot.index] = std::move(values_[last]);
+            fds_[slot.index] = fds_[last];
+            slots_[fds_[last]].index = slot.index;
+        }
+        values_.pop_back();
+        fds_.pop_back();
+        slot.index = NPOS;
+        slot.gen++;
+        (void)value;
+        return true;
+    }
+
+    // the generation of the fd, bumped by each Erase()
+    uint32_t Generation(int fd) const { return (fd >= 0 && (size_t)fd < slots_.size()) ? slots_[fd].gen : 0; }
+
+    size_t Size() const { return values_.size(); }
+    bool Empty() const { return values_.empty(); }
+
+    // calls fn(fd, value) for each value in the packed order. fn may erase the current value,
+    // the values moved by the erasing are visited already, as the iteration is backward.
+    template<typename Fn>
+    void ForEach(const Fn& fn)
+    {
+        for (size_t i = values_.size(); i > 0; --i) {
+            if (i > values_.size()) continue;   // more values erased by the last call
+            fn(fds_[i - 1], values_[i - 1]);
+        }
+    }
+
+    // the values are released after the table is emptied, their destructors may use it
+    void Clear()
+    {
+        std::vector<T> values;
+        values.swap(values_);
+        for (size_t i = 0; i < fds_.size(); ++i) {
+            Slot& slot = slots_[fds_[i]];
+            slot.index = NPOS;
+            slot.gen++;
+        }
+        fds_.clear();
+    }
+
+    private:
+    std::vector<Slot>   slots_;     // indexed by fd
+    std::vector<T>      values_;    // packed
+    std::vector<int>    fds_;       // the fd of each value
+};
+
+}  // ns evt_loop
+
+#endif  // _FD_TABLE_H
@@ -0,0 +1,157 @@
+#ifndef _LOOP_STATS_H
+#define _LOOP_STATS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <typeinfo>
+#include "event.h"
+
+namespace evt_loop {
+
+// log-linear histogram of durations in nanoseconds, like HdrHistogram: each power of 2
+// is split into SUB_BUCKETS linear buckets, so a value is kept with a relative error
+// of 1/SUB_BUCKETS at most. recording is a few instructions and never allocates.
+class LatencyHistogram {
+ public:
+  static const int      SUB_BITS = 3;
+  static const int      SUB_BUCKETS = 1 << SUB_BITS;
+  static const int      MAX_BITS = 40;    // about 18 minutes, the larger values are clamped
+  static const uint32_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+ public:
+  LatencyHistogram() { Reset(); }
+
+  void Record(int64_t ns);
+  void Merge(const LatencyHistogram& other);
+  void Reset();
+
+  uint64_t Count() const { return count_; }
+  int64_t  Min() const { return count_ ? min_ : 0; }
+  int64_t  Max() const { return max_; }
+  int64_t  Mean() const { return count_ ? (int64_t)(sum_ / count_) : 0; }
+  uint64_t Sum() const { return sum_; }
+  // the upper bound of the bucket holding the percentile, 0 < percentile <= 100
+  int64_t  Percentile(double percentile) const;
+
+ private:
+  static uint32_t BucketIndex(uint64_t ns);
+  static int64_t  BucketUpperBound(uint32_t index);
+
+ private:
+  uint64_t  counts_[BUCKETS];
+  uint64_t  count_;
+  uint64_t  sum_;
+  int64_t   min_;
+  int64_t   max_;
+};
+
+// the instrumentation of an EventLoop, see EventLoop::GetStats().
+struct LoopStats {
+  // the phases of a loop iteration, in the order they run
+  enum Phase {
+    TIMER,    // expired timers
+    FILE,     // handlers of the fds reported by the poller, the waiting excluded
+    READY,    // handlers of the events marked ready
+    TASK,     // tasks queued in loop
+    IDLE,     // idle events
+    TICK,     // tick events
+    PHASES
+  };
+  static const char* PhaseName(int phase);
+
+  uint64_t  iterations;
+  uint64_t  wait_ns;      // time blocked in the poller
+  uint64_t  busy_ns;      // time running the phases
+  uint64_t  events[PHASES];   // events processed in each phase
+  uint64_t  stale_events;     // reported for the fds deleted earlier in the batch, dropped
+
+  // busy polling, see EventLoop::EnableBusyPoll()
+  uint64_t  spin_polls;       // polls with timeout 0 while spinning
+  uint64_t  spin_hits;        // spinning polls found events, the wake ups saved
+  uint64_t  spin_ns;          // time in the spinning polls, the cpu paid for the latency
+  uint64_t  spin_fallbacks;   // spin windows ran out without events, the loop blocked then
+  int64_t   spin_window_ns;   // the current spin window, the largest one if merged
+
+  LatencyHistogram  phase_latency[PHASES];
+  LatencyHistogram  iteration_latency;  // the whole iteration, the wait included, wake up to wake up
+  LatencyHistogram  busy_latency;       // time running the phases of an iteration
+  LatencyHistogram  wait_latency;       // time blocked in the poller of an iteration
+  // loop lag, how late the timers are processed after the expiration, for both the
+  // wake up of the kernel and the handlers running before them
+  LatencyHistogram  loop_lag;
+
+  LoopStats() { Reset(); }
+  void Reset();
+  void Merge(const LoopStats& other);
+  // multiline summary, percentiles in microseconds
+  std::string ToString() const;
+};
+
+// cumulative counters of a handler in the CallbackProfiler
+struct HandlerStats {
+  std::string name;
+  uint64_t  calls;
+  uint64_t  slow_calls;   // calls took the threshold or longer
+  uint64_t  wall_ns;
+  uint64_t  cpu_ns;       // cpu time of the loop thread, the time blocked excluded
+  int64_t   max_ns;       // the longest call in wall time
+
+  HandlerStats() : calls(0), slow_calls(0), wall_ns(0), cpu_ns(0), max_ns(0) { }
+};
+
+// measures the callbacks dispatched by an EventLoop, and attributes the time to the handlers
+// by IEvent::Name() or the type of the event. see EventLoop::EnableProfiler().
+class CallbackProfiler {
+ public:
+  // the handler, the wall time and the cpu time of the slow call
+  typedef std::function<void (const HandlerStats&, int64_t, int64_t)> OnSlowCallback;
+
+  // measures the callback called in the scope, it does nothing if the profiler is NULL.
+  // the event may be deleted by the callback, it is not touched after the construction.
+  class Scope {
+   public:
+    Scope(CallbackProfiler* profiler, const IEvent* e) : profiler_(profiler) {
+      if (profiler_) profiler_->Begin(*this, e->Name() ? e->Name() : typeid(*e).name(), e->Name() == NULL);
+    }
+    Scope(CallbackProfiler* profiler, const char* name) : profiler_(profiler) {
+      if (profiler_) profiler_->Begin(*this, name, false);
+    }
+    ~Scope() { if (profiler_) profiler_->End(*this); }
+
+   private:
+    friend class CallbackProfiler;
+    CallbackProfiler* profiler_;
+    const char* key_;
+    bool        type_name_;
+    int64_t     wall_begin_;
+    int64_t     cpu_begin_;
+  };
+
+ public:
+  CallbackProfiler() : threshold_ns_(0) { }
+
+  void SetThreshold(int64_t ns) { threshold_ns_ = ns; }
+  int64_t Threshold() const { return threshold_ns_; }
+  // the slow calls are printed if it is empty
+  void SetSlowCallback(const OnSlowCallback& cb) { slow_cb_ = cb; }
+
+  // copies the counters of the handlers, the most wall time first
+  void GetHandlerStats(std::vector<HandlerStats>& stats) const;
+  void Reset() { handlers_.clear(); }
+
+ private:
+  void Begin(Scope& scope, const char* key, bool type_name);
+  void End(const Scope& scope);
+
+ private:
+  int64_t         threshold_ns_;
+  OnSlowCallback  slow_cb_;
+  std::unordered_map<const char*, HandlerStats> handlers_;  // by the name pointer
+};
+
+}  // ns evt_loop
+
+#endif  // _LOOP_STATS_H
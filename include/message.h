@@ -4,8 +4,12 @@
 #include <string.h>
 #include <string>
 #include <queue>
+#include <deque>
 #include <memory>
+#include <atomic>
+#include <utility>
 #include <functional>
+#include "buffer.h"
 
 #define UNUSED(var) ((void)var)
 
@@ -21,83 +25,125 @@ enum MessageType {
 
 class Message {
   public:
-  Message(MessageType type) : type_(type) { }
+  static const uint32_t BLOCK_SIZE = 256;   // of the blocks of the data copied in
+
+  public:
+  Message(MessageType type) : refs_(0), pooled_(false), type_(type), data_(BLOCK_SIZE), data_str_valid_(false) { }
+  // the copy shares the blocks of the data, it is not referenced by the MessagePtrs of the other
+  Message(const Message& other)
+    : refs_(0), pooled_(false), type_(other.type_), data_(other.data_), data_str_valid_(false) { }
+  Message& operator=(const Message& other) {
+    type_ = other.type_;
+    data_ = other.data_;
+    data_str_valid_ = false;
+    return *this;
+  }
+  virtual ~Message() { }
+
+  // the count of the MessagePtrs, the message is released to the pool of the thread at 0
+  void Ref()    { refs_.fetch_add(1, std::memory_order_relaxed); }
+  void Unref()  { if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) Release(this); }
 
   virtual size_t MoreSize() const = 0;
   virtual bool Completion() const = 0;
-  virtual size_t AppendData(const char* data, uint32_t length) = 0;
-  virtual size_t AssignData(const char* data, uint32_t length, bool has_hdr = false) = 0;
+  // the data can never complete a message, e.g. a header of a bad length. it takes no more
+  // data, the connection is to be closed.
+  virtual bool Broken() const { return false; }
+  // copies the bytes of the message from the data, returns the number of bytes taken
+  size_t AppendData(const char* data, uint32_t length);
+  // takes the bytes of the message from the front of the buffer, the blocks of the buffer
+  // are referenced instead of copied, so the message is a view into it.
+  size_t AppendData(Buffer& buf);
+  virtual size_t AssignData(const char* data, uint32_t length, bool has_hdr = false);
 
   MessageType Type() const        { return type_; }
-  const std::string& Data() const { return data_; }
-  size_t Size() const             { return data_.size(); }
-  bool Empty() const              { return data_.empty(); }
+  // the bytes of the data in place, contiguous once the message is completed
+  const char* Bytes() const       { return data_.Data(); }
+  // a copy of the data, for the callers of the string interface. it is made by the first call
+  // after a change of the data, Bytes() and Size() take no copy.
+  const std::string& Data() const;
+  const Buffer& GetBuffer() const { return data_; }
+  size_t Size() const             { return data_.Size(); }
+  bool Empty() const              { return data_.Empty(); }
+  // copies the data if its blocks are shared with other buffers, before writing into it
+  void Unshare();
 
   void DumpHex(size_t max_bytes = 0) const;
   void DumpHex(const char* tag, size_t max_bytes = 0) const;
 
-  virtual void Clear()                    { data_.clear(); }
-  virtual const char* Payload() const     { return data_.data(); }
-  virtual size_t PayloadSize() const      { return data_.size(); }
+  // the block of the data is kept to be reused if it is not shared
+  virtual void Clear()                    { data_.Recycle(MAX_RECYCLED_BLOCK_SIZE); data_str_valid_ = false; }
+  virtual const char* Payload() const     { return data_.Data(); }
+  virtual size_t PayloadSize() const      { return data_.Size(); }
+
+  protected:
+  // returns the number of the bytes of the data belonging to the message, the state of the
+  // parsing is updated. the data follows the bytes taken by the earlier calls.
+  virtual size_t Scan(const char* data, size_t length) = 0;
+  virtual void OnCompleted()              { data_.Linearize(); }
+
+  private:
+  friend class MessagePool;
+  static const uint32_t MAX_RECYCLED_BLOCK_SIZE = 4096;
+  static void Release(Message* msg);
+
+  private:
+  std::atomic<uint32_t> refs_;
+  bool          pooled_;      // allocated by the pool, it is recycled instead of deleted
 
   protected:
   MessageType   type_;
-  std::string   data_;
+  Buffer        data_;
+
+  private:
+  mutable std::string data_str_;    // see Data()
+  mutable bool        data_str_valid_;
 };
 
 class CRLFMessage : public Message {
   public:
-  CRLFMessage() : Message(MessageType::CRLF) { }
+  CRLFMessage() : Message(MessageType::CRLF), completed_(false) { }
 
-  CRLFMessage(const std::string& data) : Message(MessageType::CRLF) {
+  CRLFMessage(const std::string& data) : Message(MessageType::CRLF), completed_(false) {
     AssignData(data.data(), data.size());
   }
-  CRLFMessage(const char* data, uint32_t length) : Message(MessageType::CRLF) {
+  CRLFMessage(const char* data, uint32_t length) : Message(MessageType::CRLF), completed_(false) {
     AssignData(data, length);
   }
-  CRLFMessage(const CRLFMessage& other) : Message(MessageType::CRLF) {
-    data_ = other.data_;
-  }
-  CRLFMessage& operator=(const CRLFMessage& rvalue) {
-    data_ = rvalue.data_;
-    return *this;
-  }
 
   size_t MoreSize() const { return 1024; }
-  bool Completion() const { return !memcmp((char*)&data_[data_.size() - 2], TERMINAL_LABEL, 2); }
-  size_t AppendData(const char* data, uint32_t size);
-  size_t AssignData(const char* data, uint32_t size, bool has_hdr = false);
+  bool Completion() const { return completed_; }
+  void Clear()            { Message::Clear(); completed_ = false; }
+
+  protected:
+  size_t Scan(const char* data, size_t size);
 
   private:
   static const char* TERMINAL_LABEL;
+  bool completed_;
 };
 
 class JsonMessage : public Message {
   public:
   JsonMessage() : Message(MessageType::JSON), lbc_(0), rbc_(0) { }
 
-  JsonMessage(const std::string& data) : Message(MessageType::JSON) {
+  JsonMessage(const std::string& data) : Message(MessageType::JSON), lbc_(0), rbc_(0) {
     AssignData(data.data(), data.size());
   }
-  JsonMessage(const char* data, uint32_t length) : Message(MessageType::JSON) {
+  JsonMessage(const char* data, uint32_t length) : Message(MessageType::JSON), lbc_(0), rbc_(0) {
     AssignData(data, length);
   }
-  JsonMessage(const JsonMessage& other) : Message(MessageType::JSON) {
-    data_ = other.data_;
-  }
-  JsonMessage& operator=(const JsonMessage& rvalue) {
-    data_ = rvalue.data_;
-    return *this;
-  }
 
   size_t MoreSize() const { return 4096; }
   bool Completion() const { return lbc_ != 0 && lbc_ == rbc_; }
-  size_t AppendData(const char* data, uint32_t size);
-  size_t AssignData(const char* data, uint32_t size, bool has_hdr = false);
-  
+  void Clear()            { Message::Clear(); lbc_ = rbc_ = 0; }
+
+  protected:
+  size_t Scan(const char* data, size_t size);
+
   private:
   size_t lbc_;
-  size_t rbc_;;
+  size_t rbc_;
 };
 
 class BinaryMessage : public Message {
@@ -126,15 +172,13 @@ class BinaryMessage : public Message {
 #pragma pack()
 
   enum { HAS_NO_HDR = false, HAS_HDR = true };
+  static const uint32_t MAX_LENGTH = 16 * 1024 * 1024;   // of a message, the header included
 
   public:
-  BinaryMessage() : Message(MessageType::BINARY), hdr_(NULL) { }
+  BinaryMessage() : Message(MessageType::BINARY), head_size_(0), hdr_(NULL) { }
   BinaryMessage(const std::string& data, bool has_hdr = HAS_HDR);
   BinaryMessage(const char* data, uint32_t length, bool has_hdr = HAS_HDR);
-  BinaryMessage(const BinaryMessage& other);
-  BinaryMessage& operator=(const BinaryMessage& rvalue);
 
-  size_t AppendData(const char* data, uint32_t length);
   size_t AssignData(const char* data, uint32_t length, bool has_hdr = HAS_HDR);
 
   void ResetHeader();
@@ -144,19 +188,80 @@ class BinaryMessage : public Message {
   BinaryMessage::HDR* Header() const    { return hdr_; }
   const char* Payload() const     { return (char*)(hdr_->payload); }
   size_t PayloadSize() const      { return hdr_ == NULL ? 0 : hdr_->length - sizeof(HDR); }
-  bool Completion() const         { return hdr_ && hdr_->length == data_.size(); }
-  void Clear()                    { Message::Clear(); hdr_ = NULL; }
+  bool Completion() const         { return head_size_ == sizeof(HDR) && head_.length == data_.Size(); }
+  bool Broken() const             { return head_size_ == sizeof(HDR) && (head_.length < sizeof(HDR) || head_.length > MAX_LENGTH); }
+  void Clear()                    { Message::Clear(); head_size_ = 0; hdr_ = NULL; }
+
+  protected:
+  size_t Scan(const char* data, size_t length);
+  void OnCompleted();
+
+  private:
+  HDR           head_;        // copied while it is parsed, it may be split in the blocks
+  size_t        head_size_;
+  HDR*          hdr_;         // in the data, once the message is completed
+};
+
+// intrusive reference to a message, the count is kept in the message, so a message is one
+// allocation, and it is recycled by the pool of the thread. see CreateMessage().
+class MessagePtr {
+  public:
+  MessagePtr() : msg_(NULL) { }
+  explicit MessagePtr(Message* msg) : msg_(msg)     { if (msg_) msg_->Ref(); }
+  MessagePtr(const MessagePtr& other) : msg_(other.msg_) { if (msg_) msg_->Ref(); }
+  MessagePtr(MessagePtr&& other) : msg_(other.msg_) { other.msg_ = NULL; }
+  ~MessagePtr()                                     { if (msg_) msg_->Unref(); }
+
+  MessagePtr& operator=(MessagePtr other) { std::swap(msg_, other.msg_); return *this; }
+  void reset()                            { MessagePtr().swap(*this); }
+  void swap(MessagePtr& other)            { std::swap(msg_, other.msg_); }
+
+  Message* get() const                    { return msg_; }
+  Message* operator->() const             { return msg_; }
+  Message& operator*() const              { return *msg_; }
+  explicit operator bool() const          { return msg_ != NULL; }
+  bool operator==(const MessagePtr& other) const { return msg_ == other.msg_; }
+  bool operator!=(const MessagePtr& other) const { return msg_ != other.msg_; }
 
   private:
-  HDR*          hdr_;
+  Message*  msg_;
 };
 
-typedef std::shared_ptr<Message>  MessagePtr;
+// the messages are taken from the pool of the thread, the released ones are recycled with
+// the blocks of their data. the pool of a thread keeps max_free messages of each type at
+// most, 1024 by default, 0 disables the pooling of the thread.
+void SetMessagePoolLimit(size_t max_free);
 
 MessagePtr CreateMessage(MessageType msg_type);
 MessagePtr CreateMessage(MessageType msg_type, const char* data, size_t length, bool bmsg_has_no_hdr = BinaryMessage::HAS_NO_HDR);
 MessagePtr CreateMessage(const Message& msg);
 
+// a message received, handed to the callback in the view delivery mode instead of a Message
+// of its own, see BufferIOEvent::EnableViewDelivery(). it points into the receive buffer and
+// is valid during the callback only, Retain() takes the message to keep it.
+class MessageView {
+  public:
+  explicit MessageView(const Message& msg) : msg_(msg), data_(msg.Bytes()), size_(msg.Size()),
+    payload_(msg.Payload()), payload_size_(msg.PayloadSize()) { }
+
+  MessageType Type() const        { return msg_.Type(); }
+  const char* Bytes() const       { return data_; }
+  size_t Size() const             { return size_; }
+  const char* Payload() const     { return payload_; }
+  size_t PayloadSize() const      { return payload_size_; }
+  const Message& GetMessage() const { return msg_; }
+
+  // a message of its own, it references the blocks of the receive buffer instead of copying
+  MessagePtr Retain() const       { return CreateMessage(msg_); }
+
+  private:
+  const Message&  msg_;
+  const char*     data_;
+  size_t          size_;
+  const char*     payload_;
+  size_t          payload_size_;
+};
+
 class MessageMQ {
   public:
   typedef std::function<void (const Message*) > MessageDispatcher;
@@ -164,22 +269,36 @@ class MessageMQ {
   void SetMessageType(const MessageType& msg_type) { msg_type_ = msg_type; }
   size_t Size() const { return mq_.size(); }
   bool Empty() const { return mq_.empty(); }
-  void Clear() { while (!mq_.empty()) { mq_.pop(); } }
-  MessagePtr& Last();
-  void Push(const MessagePtr& msg) { mq_.push(msg); }
-  MessagePtr& First();
-  void EraseFirst() { mq_.pop(); }
+  void Clear() { mq_.clear(); }
+  // the last and the first message, a null one if the queue is empty. no message is
+  // allocated for an empty queue.
+  MessagePtr& Last()  { return mq_.empty() ? None() : mq_.back(); }
+  void Push(const MessagePtr& msg) { mq_.push_back(msg); }
+  MessagePtr& First() { return mq_.empty() ? None() : mq_.front(); }
+  void EraseFirst() { if (!mq_.empty()) mq_.pop_front(); }
+  // the i-th message from the first one, it must exist
+  const MessagePtr& At(size_t i) const { return mq_[i]; }
+
+  // an empty queue is not completed
+  size_t NeedMore() { return mq_.empty() ? 0 : Last()->MoreSize(); }
+  bool LastCompletion() { return !mq_.empty() && Last()->Completion(); }
+  bool FirstCompletion() { return !mq_.empty() && First()->Completion(); }
+
+  // returns false if the data is broken, see Message::Broken(), the data after it is not taken
+  bool AppendData(const char* data, uint32_t size);
+  // takes the messages from the front of the buffer by referencing its blocks. returns false
+  // if the data is broken, the bytes from the broken message on are left in the buffer.
+  bool AppendData(Buffer& buf);
+  // dispatches the completed messages, max_msgs of them at most if it is not 0
+  size_t Apply(MessageDispatcher& cb, size_t max_msgs = 0);
 
-  size_t NeedMore() { return Last()->MoreSize(); }
-  bool LastCompletion() { return Last()->Completion(); }
-  bool FirstCompletion() { return First()->Completion(); }
-
-  void AppendData(const char* data, uint32_t size);
-  void Apply(MessageDispatcher& cb);
+  private:
+  MessagePtr& None() { none_.reset(); return none_; }   // reset in case the caller assigned it
 
   private:
   MessageType msg_type_;
-  std::queue<MessagePtr> mq_;
+  std::deque<MessagePtr> mq_;
+  MessagePtr  none_;
 };
 
 }  // evt_loop
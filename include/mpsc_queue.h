@@ -0,0 +1,71 @@
+#ifndef _MPSC_QUEUE_H
+#define _MPSC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <utility>
+
+namespace evt_loop {
+
+// unbounded multi-producer single-consumer queue (Dmitry Vyukov's algorithm).
+// Push is wait-free and may be called from any thread, Pop/Empty must be called
+// from the consumer thread only.
+template<typename T>
+class MpscQueue
+{
+    struct Node {
+        std::atomic<Node*> next;
+        T value;
+
+        Node() : next(NULL) { }
+        Node(const T& v) : next(NULL), value(v) { }
+    };
+
+    public:
+    MpscQueue() : head_(new Node), tail_(head_.load()) { }
+    ~MpscQueue()
+    {
+        T value;
+        while (Pop(value)) { }
+        delete tail_;
+    }
+
+    void Push(const T& value)
+    {
+        Node* node = new Node(value);
+        Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // returns false if the queue is empty, or the last push is not completed yet
+    bool Pop(T& value)
+    {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (next == NULL) return false;
+
+        value = std::move(next->value);
+        next->value = T();
+        tail_ = next;
+        delete tail;
+        return true;
+    }
+
+    // true if nothing was pushed, including the pushes in progress
+    bool Empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_;
+    }
+
+    private:
+    MpscQueue(const MpscQueue&);
+    MpscQueue& operator= (const MpscQueue&);
+
+    private:
+    std::atomic<Node*> head_;   // the last pushed node, updated by producers
+    Node* tail_;                // the stub node, next of it is the first node to pop
+};
+
+}  // ns evt_loop
+
+#endif // _MPSC_QUEUE_H
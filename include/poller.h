@@ -1,11 +1,23 @@
 #ifndef _POLLER_H
 #define _POLLER_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <functional>
-
-#if defined(USE_SELECT)
+#include <vector>
 #include <sys/select.h>
 #include <map>
+
+#if defined(__linux__) && !defined(DISABLE_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#if defined(HAVE_IO_URING)
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
 #endif
 
 namespace evt_loop {
@@ -15,7 +27,8 @@ enum FileEvent {
   WRITE = 1 << 1,
   ERROR = 1 << 2,
   CREATE = 1 << 3,
-  CLOSED = 1 << 4
+  CLOSED = 1 << 4,
+  EDGE = 1 << 5     // edge-triggered, the handler must drain the fd, ignored by select
 };
 
 enum PollerCtrl {
@@ -24,25 +37,209 @@ enum PollerCtrl {
   DELETE
 };
 
+// operations done by the poller in completion mode
+enum PollerCompletion {
+  RECV_MULTISHOT,   // receives into the buffers provided by the poller
+  ACCEPT_MULTISHOT
+};
+
 class Poller
 {
+  public:
   typedef std::function<void (void*, uint32_t)> PollCallback;
+  // userdata, result (bytes received or fd accepted, -errno on failure), data received
+  typedef std::function<void (void*, int, const char*)> CompletionCallback;
   static const uint32_t MAX_EVENTS = 256;
 
   public:
-  Poller();
-  ~Poller();
+  Poller() : syscalls_saved_(0) { }
+  virtual ~Poller() { }
+  virtual int Poll(uint32_t wait_ms, const PollCallback& poll_cb) = 0;
+  virtual int SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata = NULL) = 0;
+  virtual const char* Name() const = 0;
+
+  // switches a registered fd to completion mode, the poller receives or accepts on it and
+  // passes the results to the completion callback in Poll(), instead of reporting READ.
+  // the data is valid during the callback only. returns -1 if the poller does not support it.
+  virtual int SetCompletion(int fd, PollerCompletion type, void* userdata) { return -1; }
+  void SetCompletionCallback(const CompletionCallback& cb) { completion_cb_ = cb; }
+
+  // places the buffers of the poller on the NUMA node, see EventLoop::SetCpuAffinity()
+  virtual void SetNumaNode(int node) { }
+
+  // number of the interest updates merged or skipped as no-op, each of them would
+  // cost a system call without the coalescing, see DeferUpdate().
+  uint64_t SyscallsSaved() const { return syscalls_saved_; }
+
+  // creates the poller by name: "io_uring", "epoll", "kqueue" or "select".
+  // the name is taken from the environment variable EL_POLLER if it is NULL,
+  // otherwise the best one of the platform is used. on linux io_uring is preferred,
+  // and epoll is the fallback when the kernel does not support it.
+  static Poller* Create(const char* name = NULL);
+
+  protected:
+  // the pollers with a system call per interest change apply ADD and DELETE at once,
+  // but record UPDATE and apply the net change of each fd by FlushUpdates() before waiting.
+  // so the WRITE event toggled on and off in a loop iteration costs nothing.
+  void DeferUpdate(int fd, uint32_t events, void* userdata);
+  void ResetInterest(int fd, uint32_t events);
+  void FlushUpdates();
+  virtual int ApplyUpdate(int fd, uint32_t events, void* userdata) { return 0; }
+
+  protected:
+  CompletionCallback completion_cb_;
+
+  private:
+  struct Interest {
+    uint32_t  applied;    // the events in the kernel
+    uint32_t  events;     // the events wanted
+    void*     userdata;
+    bool      dirty;      // in update_fds_, to be applied
+
+    Interest() : applied(0), events(0), userdata(NULL), dirty(false) { }
+  };
+  std::vector<Interest> interests_;   // indexed by fd
+  std::vector<int>      update_fds_;
+  uint64_t              syscalls_saved_;
+};
+
+#if defined(__linux__)
+class EpollPoller : public Poller
+{
+  public:
+  EpollPoller();
+  ~EpollPoller();
   int Poll(uint32_t wait_ms, const PollCallback& poll_cb);
   int SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata = NULL);
+  const char* Name() const { return "epoll"; }
+
+  protected:
+  int ApplyUpdate(int fd, uint32_t events, void* userdata);
 
   private:
   int pfd_;
-#if defined(USE_SELECT)
+};
+#endif
+
+#if defined(HAVE_IO_URING)
+// io_uring with one-shot IORING_OP_POLL_ADD requests, it keeps the level-triggered
+// semantic of the other pollers, and uses multishot poll requests for FileEvent::EDGE. the interest changes are recorded and submitted in
+// batch together with the waiting, so a Poll() costs one io_uring_enter only.
+// in completion mode it receives by multishot IORING_OP_RECV into a provided-buffer
+// ring, and accepts by multishot IORING_OP_ACCEPT.
+class UringPoller : public Poller
+{
+  static const int      NO_COMPLETION = -1;
+  static const uint32_t BUF_COUNT = 256;    // power of 2
+  static const uint32_t BUF_SIZE  = 4096;
+
+  struct FdEntry {
+    void*     userdata;
+    uint32_t  events;     // the events wanted
+    uint32_t  gen;        // generation, bumped for each request of the fd
+    uint64_t  armed;      // user_data of the poll request in flight (multishot if EDGE), 0 if none
+    uint64_t  multishot;  // user_data of the multishot recv/accept request in flight, 0 if none
+    int       completion; // PollerCompletion, or NO_COMPLETION
+    bool      finished;   // the multishot request got EOF or error, not to rearm
+    bool      dirty;      // in dirty_fds_, to be (re)armed
+
+    FdEntry() : userdata(NULL), events(0), gen(0), armed(0), multishot(0),
+      completion(NO_COMPLETION), finished(false), dirty(false) { }
+  };
+
+  public:
+  UringPoller();
+  ~UringPoller();
+  bool Init(uint32_t entries = MAX_EVENTS);
+  int Poll(uint32_t wait_ms, const PollCallback& poll_cb);
+  int SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata = NULL);
+  int SetCompletion(int fd, PollerCompletion type, void* userdata);
+  void SetNumaNode(int node);
+  const char* Name() const { return "io_uring"; }
+
+  private:
+  void Disarm(FdEntry& entry);
+  void DisarmMultishot(FdEntry& entry);
+  void MarkDirty(int fd, FdEntry& entry);
+  bool ArmEntry(int fd, FdEntry& entry);
+  void FlushChanges();
+  bool InitBufRing();
+  void RecycleBuffer(uint16_t bid);
+  void BindBufRing();
+  ::io_uring_sqe* GetSqe();
+  int Enter(uint32_t to_submit, uint32_t min_complete, uint32_t wait_ms);
+
+  private:
+  int ring_fd_;
+  uint32_t features_;
+
+  // submission queue
+  void*     sq_ring_;
+  size_t    sq_ring_size_;
+  uint32_t* sq_head_;
+  uint32_t* sq_tail_;
+  uint32_t* sq_mask_;
+  uint32_t* sq_array_;
+  ::io_uring_sqe* sqes_;
+  size_t    sqes_size_;
+  uint32_t  sq_pending_;    // sqes filled but not submitted
+
+  // completion queue
+  void*     cq_ring_;
+  size_t    cq_ring_size_;
+  uint32_t* cq_head_;
+  uint32_t* cq_tail_;
+  uint32_t* cq_mask_;
+  ::io_uring_cqe* cqes_;
+
+  // provided-buffer ring for the multishot receiving
+  ::io_uring_buf_ring* buf_ring_;
+  char*     buf_base_;
+  uint16_t  buf_tail_;
+  int       buf_ring_state_;  // 0: not initialized, 1: registered, -1: not supported
+  int       numa_node_;       // the node of the buffers, -1 for the default policy
+
+  std::vector<FdEntry>  fd_entries_;
+  std::vector<int>      dirty_fds_;
+  std::vector<uint64_t> cancels_;   // requests to cancel
+};
+#endif
+
+#if defined(__macosx__) || defined(__darwin__) || defined(__APPLE__) || defined(__freebsd__)
+class KqueuePoller : public Poller
+{
+  public:
+  KqueuePoller();
+  ~KqueuePoller();
+  int Poll(uint32_t wait_ms, const PollCallback& poll_cb);
+  int SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata = NULL);
+  const char* Name() const { return "kqueue"; }
+
+  protected:
+  int ApplyUpdate(int fd, uint32_t events, void* userdata);
+
+  private:
+  int Control(int fd, PollerCtrl ctrl, uint32_t events, void* userdata);
+
+  private:
+  int pfd_;
+};
+#endif
+
+class SelectPoller : public Poller
+{
+  public:
+  SelectPoller();
+  ~SelectPoller();
+  int Poll(uint32_t wait_ms, const PollCallback& poll_cb);
+  int SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata = NULL);
+  const char* Name() const { return "select"; }
+
+  private:
   std::map<int, void*> m_fd_userdata_map;
   int m_anfdmax;
   fd_set* m_fd_set_ri;
   fd_set* m_fd_set_wi;
-#endif
 };
 
 }  // ns evt_loop
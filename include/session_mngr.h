@@ -34,7 +34,7 @@ typedef std::shared_ptr<TimeoutSession>  TimeoutSessionPtr;
 class TimeoutSessionManager
 {
     public:
-    TimeoutSessionManager(uint32_t timeout = 0);
+    TimeoutSessionManager(uint32_t timeout = 0, EventLoop* el = NULL);
     void SetupTimeoutChecker(uint32_t timeout);
     void AddSession(const TimeoutSessionPtr& sess);
     TimeoutSession* GetSession(SessionID sid);
@@ -1,11 +1,13 @@
 #ifndef _SIGNAL_HANDLER_H
 #define _SIGNAL_HANDLER_H
 
+#include <stdio.h>
 #include <signal.h>
 #include <set>
 #include <map>
 #include <functional>
 #include "event.h"
+#include "fd_handler.h"
 
 using std::set;
 using std::map;
@@ -67,7 +69,8 @@ class SignalHandler : public SignalEvent
 {
   typedef function<void (SignalHandler*, uint32_t)>   OnSignalCallback;
   public:
-  SignalHandler(SIGNO signo, const OnSignalCallback& cb);
+  // added to the loop given, or to EventLoop::Current() if it is NULL
+  SignalHandler(SIGNO signo, const OnSignalCallback& cb, EventLoop* el = NULL);
   ~SignalHandler();
 
   private:
@@ -80,28 +83,34 @@ class SignalHandler : public SignalEvent
   OnSignalCallback   signal_cb_;
 };
 
-// singleton class that manages all signals
-class SignalManager {
+// dispatches the signals of an EventLoop as ordinary readable events, created by the loop for
+// its first SignalEvent. on linux the signals are blocked in the loop thread and read from
+// a signalfd in batch, a signal caught by another thread is forwarded to the loop thread.
+// on the other platforms the signal handler writes the signal number to a pipe.
+// so the SignalEvents are always called on the loop thread, never in the signal context.
+class SignalManager : public IOEvent {
+  static const int BATCH = 16;  // signals read at once
+
  public:
+  SignalManager();
+  ~SignalManager();
+
   int AddEvent(SignalEvent *e);
   int DeleteEvent(SignalEvent *e);
   int UpdateEvent(SignalEvent *e);
 
- private:
-  friend void HandleSignal(int signo);
-  map<int, set<SignalEvent *> > sig_events_;
+ protected:
+  void OnEvents(uint32_t events);
 
- public:
-  static SignalManager *Instance() {
-    if (!instance_) {
-      instance_ = new SignalManager();
-    }
-    return instance_;
-  }
  private:
-  SignalManager() {}
+  bool Watch(int signo);
+  void Unwatch(int signo);
+  void Dispatch(int signo);
+
  private:
-  static SignalManager* instance_;
+  int       wfd_;   // the write end of the pipe, -1 with signalfd
+  sigset_t  mask_;  // the signals watched
+  map<int, set<SignalEvent *> > sig_events_;
 };
 
 }  // namespace evt_loop
@@ -11,12 +11,14 @@ class TcpServer;
 class TcpClient;
 class TcpConnection;
 class Message;
+class MessageView;
 
 typedef std::function<void (TcpServer*, int, const char*) >         OnServerErrorCallback;
 typedef std::function<void (TcpClient*, int, const char*) >         OnClientErrorCallback;
 typedef std::function<void (TcpConnection*) >                       OnNewClientCallback;
 
 typedef std::function<void (TcpConnection*, const Message*) >       OnMsgRecvdCallback;
+typedef std::function<void (TcpConnection*, const MessageView&) >   OnMsgViewRecvdCallback;
 typedef std::function<void (TcpConnection*, const Message*) >       OnMsgSentCallback;
 typedef std::function<void (TcpConnection*) >                       OnClosedCallback;
 typedef std::function<void (TcpConnection*, int, const char*) >     OnErrorCallback;
@@ -36,6 +38,9 @@ struct TcpCallbacks {
 
     public:
     OnMsgRecvdCallback  on_msg_recvd_cb;
+    // takes the place of on_msg_recvd_cb if it is set, the messages are delivered as views
+    // into the receive buffer without a Message allocated for each
+    OnMsgViewRecvdCallback on_msg_view_recvd_cb;
     OnMsgSentCallback   on_msg_sent_cb;
     OnClosedCallback    on_closed_cb;
     OnErrorCallback     on_error_cb;
@@ -14,8 +14,9 @@ namespace evt_loop {
 class TcpClient : public IOEvent
 {
     public:
+    // the client and its connection run on the loop given, or on EventLoop::Current() if it is NULL
     TcpClient(const char *host="", uint16_t port=0, MessageType msg_type = MessageType::BINARY,
-          bool auto_reconnect = true, TcpCallbacksPtr tcp_evt_cbs = nullptr);
+          bool auto_reconnect = true, TcpCallbacksPtr tcp_evt_cbs = nullptr, EventLoop* el = NULL);
     ~TcpClient();
 
     bool Connect();
@@ -46,7 +47,7 @@ class TcpClient : public IOEvent
     virtual TcpConnectionPtr CreateClient(int fd, const IPAddress& local_addr, const IPAddress& peer_addr, const IPAddress& peer_real_addr)
     {
         return std::make_shared<TcpConnection>(fd, local_addr, peer_addr, peer_real_addr,
-                std::bind(&TcpClient::OnConnectionClosed, this, std::placeholders::_1), tcp_evt_cbs_);
+                std::bind(&TcpClient::OnConnectionClosed, this, std::placeholders::_1), tcp_evt_cbs_, el_);
     }
     void Reconnect();
 
@@ -80,7 +81,7 @@ class TcpClient6 : public TcpClient
 {
   public:
     TcpClient6(const char *host="", uint16_t port=0, MessageType msg_type = MessageType::BINARY,
-          bool auto_reconnect = true, TcpCallbacksPtr tcp_evt_cbs = nullptr);
+          bool auto_reconnect = true, TcpCallbacksPtr tcp_evt_cbs = nullptr, EventLoop* el = NULL);
 
   protected:
     virtual void InitAddress(const char* host, uint16_t port);
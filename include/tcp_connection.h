@@ -5,6 +5,7 @@
 #include <memory>
 
 #include "fd_handler.h"
+#include "fd_table.h"
 #include "tcp_callbacks.h"
 #include "tcp_heartbeat_handler.h"
 #include "utils.h"
@@ -18,7 +19,7 @@ class TcpConnection : public BufferIOEvent
 {
   public:
     TcpConnection(int fd, const IPAddress& local_addr, const IPAddress& peer_addr, const IPAddress& peer_real_addr,
-            const OnClosedCallback& close_cb, TcpCallbacksPtr tcp_evt_cbs = nullptr);
+            const OnClosedCallback& close_cb, TcpCallbacksPtr tcp_evt_cbs = nullptr, EventLoop* el = NULL);
     ~TcpConnection();
 
     uint32_t ID() const { return id_; }
@@ -31,7 +32,11 @@ class TcpConnection : public BufferIOEvent
     bool IsClient() const { return is_client_; }
     void Disconnect();
 
-    void SetTcpCallbacks(const TcpCallbacksPtr& tcp_evt_cbs) { tcp_evt_cbs_ = tcp_evt_cbs; }
+    void SetTcpCallbacks(const TcpCallbacksPtr& tcp_evt_cbs)
+    {
+        tcp_evt_cbs_ = tcp_evt_cbs;
+        EnableViewDelivery(tcp_evt_cbs_ && tcp_evt_cbs_->on_msg_view_recvd_cb);
+    }
     void SetReadyCallback(const OnReadyCallback& cb) { on_conn_ready_cb_ = cb; }
 
     void EnableHeartbeat(uint32_t idle_interval = TcpHeartbeatHandler::DFT_IDLE_INTERVAL,
@@ -82,7 +87,7 @@ class TcpConnection : public BufferIOEvent
 };
 
 typedef shared_ptr<TcpConnection>          TcpConnectionPtr;
-typedef map<int/*fd*/, TcpConnectionPtr>   FdTcpConnMap;
+typedef FdTable<TcpConnectionPtr>          TcpConnTable;
 
 typedef tuple<uint32_t, OnIdleTimeoutCallback>  IdleTimeoutParams;
 typedef shared_ptr<IdleTimeoutParams>           IdleTimeoutParamsPtr;
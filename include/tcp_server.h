@@ -1,20 +1,107 @@
 #ifndef _TCP_SERVER_H
 #define _TCP_SERVER_H
 
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include "tcp_connection.h"
+#include "eventloop_group.h"
 
 namespace evt_loop {
 
+class TcpServerShard;
+
+// counters of the accepting of a TcpServer, see TcpServer::GetAcceptStats()
+struct AcceptStats {
+    // the reasons of the connections rejected by the admission control
+    enum Reject {
+        MAX_CONNECTIONS,    // SetMaxConnections()
+        MAX_PER_IP,         // SetMaxConnectionsPerIP()
+        ACCEPT_RATE,        // SetAcceptRate()
+        REJECT_REASONS
+    };
+
+    uint64_t accepted;      // connections accepted, the rejected ones included
+    uint64_t wakeups;       // READ events of the listeners, or the accept completions
+    uint64_t full_batches;  // wakeups stopped by the batch limit with the backlog not drained
+    uint64_t errors;        // accepts failed, EAGAIN excluded, the connections dropped out of fds included
+    uint32_t max_batch;     // the most connections accepted in a wakeup
+    uint64_t rejected[REJECT_REASONS];  // closed at once after accepted
+    uint64_t shed_pauses;   // times a listener stopped accepting for the loop lag, see EnableShedding()
+    uint64_t shed_ns;       // time the listeners were paused, the pauses ended only
+
+    AcceptStats() { Reset(); }
+    void Reset();
+    void Merge(const AcceptStats& other);
+    double AcceptedPerWakeup() const { return wakeups ? (double)accepted / wakeups : 0.0; }
+};
+
 class TcpServer: public IOEvent
 {
+    friend class TcpServerShard;
+
     public:
-    TcpServer(const char *host ="", uint16_t port=0, MessageType msg_type = MessageType::BINARY, TcpCallbacksPtr tcp_evt_cbs = nullptr);
+    static const uint32_t DFT_ACCEPT_BATCH = 64;
+
+    // the server accepts on the loop given, or on EventLoop::Current() if it is NULL
+    TcpServer(const char *host ="", uint16_t port=0, MessageType msg_type = MessageType::BINARY, TcpCallbacksPtr tcp_evt_cbs = nullptr,
+            EventLoop* el = NULL);
     ~TcpServer();
     void Destroy();
 
     const IPAddress& GetAddress() const { return server_addr_; }
+    // looks up the connections owned by the loop of the caller
     TcpConnectionPtr GetConnectionByFD(int fd);
-    uint32_t GetConnectionNumber() const { return conn_map_.size(); }
+    // the connections of the server on all the loops, the ones in the handoff excluded
+    uint32_t GetConnectionNumber() const;
+
+    // distributes the accepted connections to the loops of the group, the callbacks of
+    // a connection are invoked on its owning loop thread. the group must outlive the server.
+    void SetEventLoopGroup(EventLoopGroup* loop_group);
+    EventLoopGroup* GetEventLoopGroup() const { return loop_group_; }
+    // dispatches a connection to the loop of the group pinned to the cpu its packets were
+    // received on (SO_INCOMING_CPU), so it is processed on the cpu and the NUMA node of its
+    // NIC queue. the connections of the cpus without a loop fall back to the policy of the group.
+    // see EventLoopGroup::SetCpuAffinity().
+    void EnableIncomingCpu(bool enable = true) { incoming_cpu_ = enable; }
+    // shards the listening: each loop of the group listens on its own SO_REUSEPORT socket of the
+    // address, and accepts and sets up its connections itself, no accept contention or handoff
+    // between the loops. with steer_by_cpu a CBPF program selects the listener of the loop pinned
+    // to the cpu the connection is received on, see EventLoopGroup::SetCpuAffinity(), otherwise
+    // the kernel selects one by the hash of the addresses. the group must be started.
+    // returns false if it is not supported, the server keeps its single listener then.
+    bool EnableReusePort(bool steer_by_cpu = true);
+    bool ReusePort() const { return !shards_.empty(); }
+
+    // the most connections accepted in a READ event, the listener is reported again if the
+    // backlog is not drained, so the other events of the loop are not starved in a storm
+    void SetAcceptBatch(uint32_t batch) { accept_batch_ = batch > 0 ? batch : 1; }
+    // copies the counters of the listeners, of the shards too. it must be called on the loop
+    // of the server, and waits for the loops of the shards.
+    void GetAcceptStats(AcceptStats& stats);
+
+    // admission control, the connections over the limits are closed right after accepted and
+    // counted by reason in AcceptStats. 0 for no limit, the limits hold for all the loops.
+    void SetMaxConnections(uint32_t max) { max_conns_ = max; }
+    void SetMaxConnectionsPerIP(uint32_t max) { max_conns_per_ip_ = max; }
+    // token bucket of the accepting: rate connections per second, burst at most at once
+    void SetAcceptRate(uint32_t rate, uint32_t burst);
+
+    // sheds the load when the loops fall behind: a listener stops accepting, its READ interest
+    // is removed and the connections wait in the backlog of the kernel, when the loop lag exceeds
+    // max_lag, and resumes when the lag falls under the half. the lag is probed by a timer of each
+    // loop every interval. the single listener follows the busiest loop of the group, a shard of
+    // EnableReusePort() its own loop, the probes are moved to the shards if it is called later.
+    // it must be called on the loop of the server.
+    void EnableShedding(const TimeVal& max_lag, const TimeVal& interval = TimeVal(0, 10000));
+    void DisableShedding();
+
+    // accepts by multishot requests and receives on the connections into the buffers of
+    // the poller, it works with io_uring only, the other pollers stay in readiness mode.
+    void EnableCompletionMode(bool enable = true);
+    // options of the connections accepted from now on, the listening socket stays level-triggered
+    void EnableEdgeTriggered(bool enable = true) { edge_triggered_ = enable; }
+    void SetIOBudget(uint32_t bytes, uint32_t messages) { budget_bytes_ = bytes; budget_msgs_ = messages; }
 
     void SetTcpCallbacks(const TcpCallbacksPtr& tcp_evt_cbs);
     void SetNewClientCallback(const OnNewClientCallback& new_client_cb) { new_client_cb_ = new_client_cb; }
@@ -26,8 +113,11 @@ class TcpServer: public IOEvent
 
     protected:
     virtual void InitAddress(const char* host, uint16_t port);
-    virtual bool Start();
-    virtual int AcceptClient(IPAddress& peer_addr);
+    bool Start();
+    // creates the listening socket of the address, -1 on failure
+    virtual int CreateListener(bool reuse_port);
+    // accepts a non-blocking connection, returns -1 with errno set on failure
+    virtual int AcceptClient(int listen_fd, IPAddress& peer_addr);
     virtual TcpConnectionPtr CreateClient(int fd, const IPAddress& local_addr, const IPAddress& peer_addr, const IPAddress& peer_real_addr)
     {
         return std::make_shared<TcpConnection>(fd, server_addr_, peer_addr, peer_real_addr,
@@ -36,13 +126,55 @@ class TcpServer: public IOEvent
 
     void OnError(int errcode, const char* errstr);
     void OnEvents(uint32_t events);
+    void OnCompletion(int res, const char* data);
     void OnNewClient(int fd, const IPAddress& peer_addr);
+    // accepts until the backlog is drained or the batch limit, for the listener or a shard
+    void AcceptClients(int listen_fd, AcceptStats& stats, TcpServerShard* shard);
+    void OnAccepted(int fd, const IPAddress& peer_addr, AcceptStats& stats, TcpServerShard* shard);
+    bool Admit(const IPAddress& peer_addr, AcceptStats& stats);
+    void ReleaseAdmission(const IPAddress& peer_addr);
+    void AttachCpuSteering(int listen_fd);
+
+    struct LagProbe;
+    void OnLagProbe(LagProbe* probe);
+    EventLoopThread* SelectLoop(int fd);
+    void SetupConnection(int fd, const IPAddress& peer_addr);
     void OnConnectionClosed(TcpConnection* conn);
 
+    TcpConnTable& LocalConnTable();
+    void ForEachConnection(const std::function<void (const TcpConnectionPtr&)>& fn);
+
     protected:
     IPAddress       server_addr_;
     MessageType     msg_type_;
-    FdTcpConnMap    conn_map_;
+    TcpConnTable    conn_table_;
+    EventLoopGroup* loop_group_;
+    bool            completion_mode_;
+    bool            edge_triggered_;
+    bool            incoming_cpu_;
+    uint32_t        budget_bytes_;
+    uint32_t        budget_msgs_;
+    uint32_t        accept_batch_;
+    AcceptStats     accept_stats_;
+    std::vector<TcpConnTable> loop_conn_tables_;  // indexed by EventLoopThread::Index()
+    std::vector<TcpServerShard*> shards_;       // indexed by EventLoopThread::Index(), see EnableReusePort()
+    int             reserve_fd_;        // freed to drop a connection when out of fds
+    std::atomic<uint32_t> conn_count_;  // connections in the tables, the loads of the loops are shared by the servers
+
+    // admission control, shared by the listeners of the shards
+    uint32_t        max_conns_;
+    uint32_t        max_conns_per_ip_;
+    std::atomic<uint32_t> conns_;       // connections admitted and not closed yet
+    std::mutex      admission_mutex_;   // for the following
+    std::unordered_map<std::string, uint32_t> ip_conns_;
+    double          accept_rate_;       // tokens per second, 0 for no limit
+    double          accept_burst_;
+    double          tokens_;
+    TimeVal         tokens_time_;
+
+    int64_t         shed_lag_ns_;
+    TimeVal         shed_interval_;
+    std::vector<std::shared_ptr<LagProbe>> lag_probes_;
 
     OnNewClientCallback     new_client_cb_;
     OnServerErrorCallback   error_cb_;
@@ -52,15 +184,38 @@ class TcpServer: public IOEvent
 };
 typedef std::shared_ptr<TcpServer> TcpServerPtr;
 
+// a SO_REUSEPORT listener of a TcpServer, registered to a loop of the group. it accepts
+// the connections on that loop, they are owned by the loop from the start.
+class TcpServerShard: public IOEvent
+{
+    friend class TcpServer;
+
+    public:
+    TcpServerShard(TcpServer* server, int fd, EventLoopThread* thread);
+    ~TcpServerShard();
+
+    protected:
+    void OnEvents(uint32_t events);
+    void OnCompletion(int res, const char* data);
+    void OnNewClient(int fd, const IPAddress& peer_addr);
+
+    private:
+    TcpServer*       server_;
+    EventLoopThread* thread_;
+    int              reserve_fd_;   // see TcpServer::reserve_fd_
+    AcceptStats      accept_stats_;
+};
+
 class TcpServer6: public TcpServer
 {
     public:
-    TcpServer6(const char *host="", uint16_t port=0, bool ipv6_only = true, MessageType msg_type = MessageType::BINARY, TcpCallbacksPtr tcp_evt_cbs = nullptr);
+    TcpServer6(const char *host="", uint16_t port=0, bool ipv6_only = true, MessageType msg_type = MessageType::BINARY, TcpCallbacksPtr tcp_evt_cbs = nullptr,
+            EventLoop* el = NULL);
 
     protected:
     void InitAddress(const char* host, uint16_t port);
-    bool Start();
-    int AcceptClient(IPAddress& peer_addr);
+    int CreateListener(bool reuse_port);
+    int AcceptClient(int listen_fd, IPAddress& peer_addr);
 
     private:
     bool ipv6_only_;
@@ -11,13 +11,28 @@
 namespace evt_loop
 {
 
+class TimerEvent;
+
+// intrusive list node, embedded in TimerEvent and used as slot head by the timing wheel
+struct TimerLink {
+  TimerLink*  prev;
+  TimerLink*  next;
+  TimerEvent* owner;
+
+  TimerLink(TimerEvent* o = NULL) : prev(NULL), next(NULL), owner(o) { }
+  bool Linked() const { return next != NULL; }
+};
+
 class TimerEvent : public IEvent {
   friend class EventLoop;
+  friend class TimerMapManager;
+  friend class TimerWheelManager;
   static const uint32_t TIMER = 1 << 0;
 
  public:
-  TimerEvent();
-  TimerEvent(const TimeVal& inter);
+  // bound to the loop given, or to EventLoop::Current() if it is NULL
+  TimerEvent(EventLoop* el = NULL);
+  TimerEvent(const TimeVal& inter, EventLoop* el = NULL);
   ~TimerEvent() { Stop(); }
 
   void SetTime(const TimeVal& tv) { time_ = tv; }
@@ -39,14 +54,18 @@ class TimerEvent : public IEvent {
   TimeVal   time_;
   TimeVal   interval_;
   bool      running_;
+
+ private:
+  TimerLink link_;
+  uint64_t  expire_tick_;
 };
 
 class PeriodicTimer : public TimerEvent {
  public:
   typedef std::function<void (TimerEvent*)>  OnTimerCallback;
 
-  PeriodicTimer(const OnTimerCallback& cb) : timer_cb_(cb) { }
-  PeriodicTimer(const TimeVal& inter, const OnTimerCallback& cb) : TimerEvent(inter), timer_cb_(cb) { }
+  PeriodicTimer(const OnTimerCallback& cb, EventLoop* el = NULL) : TimerEvent(el), timer_cb_(cb) { }
+  PeriodicTimer(const TimeVal& inter, const OnTimerCallback& cb, EventLoop* el = NULL) : TimerEvent(inter, el), timer_cb_(cb) { }
 
  protected:
   void OnTimer() override { timer_cb_(this); }
@@ -57,8 +76,8 @@ class PeriodicTimer : public TimerEvent {
 
 class OneshotTimer : public PeriodicTimer {
  public:
-  OneshotTimer(const OnTimerCallback& cb) : PeriodicTimer(cb) { }
-  OneshotTimer(const TimeVal& inter, const OnTimerCallback& cb) : PeriodicTimer(inter, cb) { }
+  OneshotTimer(const OnTimerCallback& cb, EventLoop* el = NULL) : PeriodicTimer(cb, el) { }
+  OneshotTimer(const TimeVal& inter, const OnTimerCallback& cb, EventLoop* el = NULL) : PeriodicTimer(inter, cb, el) { }
 
  protected:
   void OnTimer() override { Stop(); PeriodicTimer::OnTimer(); }
@@ -66,14 +85,32 @@ class OneshotTimer : public PeriodicTimer {
 typedef std::shared_ptr<PeriodicTimer>           PeriodicTimerPtr;
 
 class TimerManager {
+ public:
+  virtual ~TimerManager() { }
+
+  virtual int AddEvent(TimerEvent *e) = 0;
+  virtual int DeleteEvent(TimerEvent *e) = 0;
+  virtual int UpdateEvent(TimerEvent *e) = 0;
+
+  // fires all timers expired at 'now', returns the number of expired timers
+  virtual int ProcessTimeout(const TimeVal& now) = 0;
+  // the time to call ProcessTimeout() next, false if there is no timer
+  virtual bool NextExpiration(TimeVal& expires) = 0;
+  virtual size_t Size() const = 0;
+};
+
+// red-black tree based timers, O(log n) for add/delete/expire
+class TimerMapManager : public TimerManager {
  public:
   int AddEvent(TimerEvent *e);
   int DeleteEvent(TimerEvent *e);
   int UpdateEvent(TimerEvent *e);
 
- private:
-  friend class EventLoop;
+  int ProcessTimeout(const TimeVal& now);
+  bool NextExpiration(TimeVal& expires);
+  size_t Size() const { return timers_.size(); }
 
+ private:
   typedef std::set<TimerEvent*> TimerSet;
   typedef std::map<TimeVal, TimerSet> TimerMap;
 
@@ -81,6 +118,50 @@ class TimerManager {
   TimerMap timers_;
 };
 
+// hierarchical timing wheel with 1ms tick, O(1) for add/delete/expire.
+// level 0 has 256 slots, levels 1-4 have 64 slots each, covering 2^32 ms (~49 days),
+// timers at upper levels are cascaded to the lower level when it wraps around.
+// the slot of the current tick is checked by the exact time, so a timer never fires early.
+class TimerWheelManager : public TimerManager {
+  static const uint32_t ROOT_BITS   = 8;
+  static const uint32_t LEVEL_BITS  = 6;
+  static const uint32_t ROOT_SIZE   = 1 << ROOT_BITS;
+  static const uint32_t LEVEL_SIZE  = 1 << LEVEL_BITS;
+  static const uint32_t ROOT_MASK   = ROOT_SIZE - 1;
+  static const uint32_t LEVEL_MASK  = LEVEL_SIZE - 1;
+  static const uint32_t LEVELS      = 4;
+  static const int64_t  NS_PER_TICK = 1000000;
+
+ public:
+  TimerWheelManager(const TimeVal& now);
+  ~TimerWheelManager();
+
+  int AddEvent(TimerEvent *e);
+  int DeleteEvent(TimerEvent *e);
+  int UpdateEvent(TimerEvent *e);
+
+  int ProcessTimeout(const TimeVal& now);
+  bool NextExpiration(TimeVal& expires);
+  size_t Size() const { return count_; }
+
+  static uint64_t ToTick(const TimeVal& tv) { return tv.Nanoseconds() / NS_PER_TICK; }
+
+ private:
+  void Link(TimerEvent *e);
+  void Cascade(uint32_t level, uint32_t index);
+  void FireSlot(uint32_t index, const TimeVal& now, bool exact, int& n);
+  void MarkRoot(uint32_t index)   { root_bitmap_[index >> 6] |= (1ULL << (index & 63)); }
+  void UnmarkRoot(uint32_t index) { root_bitmap_[index >> 6] &= ~(1ULL << (index & 63)); }
+  int FindRoot(uint32_t from) const;
+
+ private:
+  uint64_t  current_tick_;
+  size_t    count_;
+  TimerLink root_[ROOT_SIZE];
+  TimerLink levels_[LEVELS][LEVEL_SIZE];
+  uint64_t  root_bitmap_[ROOT_SIZE / 64];
+};
+
 }  // namepace evt_loop
 
 #endif  // _TIMER_HANDLER_H
@@ -18,7 +18,8 @@ class UserEvent : public IEvent {
   typedef std::function<void (uint32_t eventid)>        OnFinishCallback;
 
  public:
-  UserEvent(const OnUserEventCallback& cb, void* udata = NULL, int32_t repeat = -1);
+  // bound to the loop given, or to EventLoop::Current() if it is NULL
+  UserEvent(const OnUserEventCallback& cb, void* udata = NULL, int32_t repeat = -1, EventLoop* el = NULL);
   uint32_t Id() const { return id_; }
 
  protected:
@@ -34,14 +35,14 @@ class UserEvent : public IEvent {
 
 class IdleEvent : public UserEvent {
   public:
-  IdleEvent(const OnUserEventCallback& cb, void* udata = NULL, int32_t repeat = -1);
+  IdleEvent(const OnUserEventCallback& cb, void* udata = NULL, int32_t repeat = -1, EventLoop* el = NULL);
  protected:
   void OnEvents(uint32_t events) override;
 };
 
 class TickEvent : public UserEvent {
   public:
-  TickEvent(const OnUserEventCallback& cb, void* udata = NULL, int32_t repeat = -1);
+  TickEvent(const OnUserEventCallback& cb, void* udata = NULL, int32_t repeat = -1, EventLoop* el = NULL);
  protected:
   void OnEvents(uint32_t events) override;
 };
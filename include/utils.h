@@ -14,15 +14,23 @@ using std::string;
 
 namespace evt_loop {
 
+// time in nanoseconds. SetNow() and Now() take the wall clock, SetMonoNow() and MonoNow()
+// take CLOCK_MONOTONIC, which is not affected by the changes of the system clock, for the
+// timers and the durations. the times of the two clocks are not to be compared.
 class TimeVal {
  public:
   TimeVal(uint32_t sec = 0, uint32_t usec = 0);
   TimeVal(const timeval& time);
+  TimeVal(const timespec& time);
   TimeVal& SetNow();
+  TimeVal& SetMonoNow();
 
   timeval Value() const;
+  timespec TimeSpec() const;
   uint32_t Seconds()  const;
   uint32_t USeconds() const;
+  uint32_t NSeconds() const;  // the fraction of the second in nanoseconds
+  int64_t  Nanoseconds() const { return ns_; }
 
   bool operator ==(const TimeVal& other) const;
    bool operator !=(const TimeVal& other) const;
@@ -32,10 +40,13 @@ class TimeVal {
   TimeVal operator+(const TimeVal& other) const;
 
   static int32_t MsDiff(const TimeVal& lv, const TimeVal& rv);
+  static int64_t NsDiff(const TimeVal& lv, const TimeVal& rv) { return lv.ns_ - rv.ns_; }
+  static TimeVal FromNs(int64_t ns);
   static TimeVal Now();
+  static TimeVal MonoNow();
 
  private:
-  timeval tv_;
+  int64_t ns_;
 };
 
 struct IPAddress
@@ -62,6 +73,15 @@ typedef std::vector<IPAddress> IPAddressList;
 void SocketAddrToIPAddress(const struct sockaddr_in& sock_addr, IPAddress& ip_addr);
 void SocketAddrToIPAddress(const struct sockaddr_in6& sock_addr, IPAddress& ip_addr);
 
+// pins the caller thread to the cpu, returns -1 on failure or if it is not supported
+int SetThreadAffinity(int cpu);
+// the NUMA node of the cpu, 0 if the system is not NUMA, -1 if the cpu is unknown
+int NumaNodeOfCpu(int cpu);
+// binds the pages of the memory to the NUMA node, the ones allocated already are moved.
+// the node is preferred rather than required, so it does not fail when the node is full.
+// returns -1 on failure or if it is not supported
+int BindMemoryToNode(void* addr, size_t len, int node);
+
 }  // namespace evt_loop
 
 #endif  // _UTILS_H
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include "buffer.h"
+
+namespace evt_loop {
+
+BufferBlock* BufferBlock::Create(uint32_t capacity, uint32_t used) {
+  void* mem = malloc(sizeof(BufferBlock) + capacity);
+  if (mem == NULL) return NULL;
+  return new (mem) BufferBlock(capacity, used);
+}
+
+void BufferBlock::Destroy() {
+  this->~BufferBlock();
+  free(this);
+}
+
+bool BufferBlock::Extend(uint32_t end, uint32_t n) {
+  if (n > Available(end)) return false;
+  return used_.compare_exchange_strong(end, end + n, std::memory_order_relaxed);
+}
+
+void BufferBlock::Unclaim(uint32_t end, uint32_t claimed) {
+  used_.compare_exchange_strong(claimed, end, std::memory_order_relaxed);
+}
+
+Buffer::Buffer(uint32_t block_size)
+  : slices_(inline_), count_(0), capacity_(INLINE_SLICES), block_size_(block_size), size_(0), prepared_(0) {
+}
+
+Buffer::Buffer(const Buffer& other)
+  : slices_(inline_), count_(0), capacity_(INLINE_SLICES), block_size_(other.block_size_), size_(0), prepared_(0) {
+  Append(other);
+}
+
+Buffer& Buffer::operator=(const Buffer& other) {
+  if (this != &other) {
+    Clear();
+    Append(other);
+  }
+  return *this;
+}
+
+Buffer::~Buffer() {
+  Clear();
+  if (slices_ != inline_) free(slices_);
+}
+
+bool Buffer::Contiguous() const {
+  // the last slice may be an empty block kept to be appended to
+  return count_ <= 1 || (count_ == 2 && slices_[1].begin == slices_[1].end);
+}
+
+const char* Buffer::Data() const {
+  if (size_ == 0) return NULL;
+  return slices_[0].block->Data() + slices_[0].begin;
+}
+
+char Buffer::At(size_t pos) const {
+  for (uint32_t i = 0; i < count_; ++i) {
+    uint32_t len = slices_[i].end - slices_[i].begin;
+    if (pos < len) return slices_[i].block->Data()[slices_[i].begin + pos];
+    pos -= len;
+  }
+  return 0;
+}
+
+size_t Buffer::CopyOut(char* dst, size_t pos, size_t len) const {
+  size_t copied = 0;
+  for (uint32_t i = 0; i < count_ && copied < len; ++i) {
+    size_t seg_len = slices_[i].end - slices_[i].begin;
+    if (pos >= seg_len) {
+      pos -= seg_len;
+      continue;
+    }
+    size_t n = std::min(seg_len - pos, len - copied);
+    memcpy(dst + copied, slices_[i].block->Data() + slices_[i].begin + pos, n);
+    copied += n;
+    pos = 0;
+  }
+  return copied;
+}
+
+const char* Buffer::Segment(size_t i, size_t* len) const {
+  *len = slices_[i].end - slices_[i].begin;
+  return slices_[i].block->Data() + slices_[i].begin;
+}
+
+void Buffer::Append(const char* data, size_t len) {
+  while (len > 0) {
+    if (count_ > 0) {
+      Span& last = slices_[count_ - 1];
+      uint32_t n = (uint32_t)std::min((size_t)last.block->Available(last.end), len);
+      if (n > 0 && last.block->Extend(last.end, n)) {
+        memcpy(last.block->Data() + last.end, data, n);
+        last.end += n;
+        size_ += n;
+        data += n;
+        len -= n;
+        continue;
+      }
+    }
+    // the headroom is reserved in the first block only
+    uint32_t headroom = count_ == 0 ? HEADROOM : 0;
+    uint32_t capacity = (uint32_t)std::max((size_t)block_size_, len + headroom);
+    Span slice = { BufferBlock::Create(capacity, headroom), headroom, headroom };
+    if (slice.block == NULL) return;
+    PushBack(slice);
+  }
+}
+
+void Buffer::Append(const Buffer& other) {
+  for (uint32_t i = 0; i < other.count_; ++i) {
+    if (other.slices_[i].begin == other.slices_[i].end) continue;
+    other.slices_[i].block->Ref();
+    PushBack(other.slices_[i]);
+  }
+}
+
+void Buffer::Prepend(const char* data, size_t len) {
+  if (len == 0) return;
+  if (count_ > 0 && slices_[0].begin >= len && slices_[0].block->Exclusive()) {
+    slices_[0].begin -= len;
+  } else {
+    uint32_t capacity = len + HEADROOM;
+    Span slice = { BufferBlock::Create(capacity, capacity), HEADROOM, capacity };
+    if (slice.block == NULL) return;
+    PushFront(slice);
+  }
+  memcpy(slices_[0].block->Data() + slices_[0].begin, data, len);
+  size_ += len;
+}
+
+char* Buffer::Prepare(size_t* len) {
+  if (count_ > 0) {
+    Span& last = slices_[count_ - 1];
+    uint32_t n = last.block->Available(last.end);
+    if (n > 0 && last.block->Extend(last.end, n)) {
+      prepared_ = last.end + n;
+      *len = n;
+      return last.block->Data() + last.end;
+    }
+  }
+  uint32_t headroom = count_ == 0 ? HEADROOM : 0;
+  Span slice = { BufferBlock::Create(std::max(block_size_, headroom + 1), headroom), headroom, headroom };
+  if (slice.block == NULL) {
+    *len = 0;
+    return NULL;
+  }
+  PushBack(slice);
+  Span& last = slices_[count_ - 1];
+  *len = last.block->Available(last.end);
+  last.block->Extend(last.end, *len);
+  prepared_ = last.end + *len;
+  return last.block->Data() + last.end;
+}
+
+void Buffer::Commit(size_t len) {
+  if (count_ == 0 || prepared_ == 0) return;
+  Span& last = slices_[count_ - 1];
+  last.end += len;
+  size_ += len;
+  if (last.end < prepared_) last.block->Unclaim(last.end, prepared_);
+  prepared_ = 0;
+}
+
+void Buffer::Slice(size_t pos, size_t len, Buffer& dst) const {
+  for (uint32_t i = 0; i < count_ && len > 0; ++i) {
+    const Span& s = slices_[i];
+    size_t seg_len = s.end - s.begin;
+    if (pos >= seg_len) {
+      pos -= seg_len;
+      continue;
+    }
+    size_t n = std::min(seg_len - pos, len);
+    Span part = { s.block, s.begin + (uint32_t)pos, s.begin + (uint32_t)(pos + n) };
+    part.block->Ref();
+    dst.PushBack(part);
+    len -= n;
+    pos = 0;
+  }
+}
+
+void Buffer::MoveTo(Buffer& dst, size_t len) {
+  while (len > 0 && count_ > 0) {
+    Span& s = slices_[0];
+    size_t seg_len = s.end - s.begin;
+    if (seg_len > len || count_ == 1) {
+      // a part of the slice, or the whole last one which is kept to be appended to
+      uint32_t n = (uint32_t)std::min(seg_len, len);
+      Span part = { s.block, s.begin, s.begin + n };
+      part.block->Ref();
+      dst.PushBack(part);
+      s.begin += n;
+      size_ -= n;
+      len -= n;
+      break;
+    }
+    if (seg_len > 0) dst.PushBack(s); else s.block->Unref();
+    size_ -= seg_len;
+    len -= seg_len;
+    PopFront();
+  }
+}
+
+void Buffer::Consume(size_t len) {
+  while (len > 0 && count_ > 0) {
+    Span& s = slices_[0];
+    size_t seg_len = s.end - s.begin;
+    if (seg_len > len || count_ == 1) {
+      uint32_t n = (uint32_t)std::min(seg_len, len);
+      s.begin += n;
+      size_ -= n;
+      break;
+    }
+    s.block->Unref();
+    size_ -= seg_len;
+    len -= seg_len;
+    PopFront();
+  }
+}
+
+void Buffer::Linearize() {
+  if (!Contiguous()) CopyInto(HEADROOM);
+}
+
+void Buffer::Unshare() {
+  for (uint32_t i = 0; i < count_; ++i) {
+    if (!slices_[i].block->Exclusive()) {
+      CopyInto(HEADROOM);
+      return;
+    }
+  }
+}
+
+void Buffer::CopyInto(uint32_t headroom) {
+  uint32_t capacity = std::max((size_t)block_size_, size_ + headroom);
+  Span slice = { BufferBlock::Create(capacity, size_ + headroom), headroom, (uint32_t)(size_ + headroom) };
+  if (slice.block == NULL) return;
+  CopyOut(slice.block->Data() + headroom, 0, size_);
+  Clear();
+  PushBack(slice);
+}
+
+void Buffer::Clear() {
+  for (uint32_t i = 0; i < count_; ++i) {
+    slices_[i].block->Unref();
+  }
+  count_ = 0;
+  size_ = 0;
+}
+
+void Buffer::Recycle(uint32_t max_capacity) {
+  if (count_ == 0) return;
+  Span last = slices_[count_ - 1];
+  uint32_t capacity = last.block->Capacity();
+  if (prepared_ != 0 || capacity <= HEADROOM || capacity > max_capacity || !last.block->Exclusive()) {
+    Clear();
+    return;
+  }
+  count_--;
+  Clear();
+  last.block->Reset(HEADROOM);
+  last.begin = last.end = HEADROOM;
+  slices_[count_++] = last;
+}
+
+void Buffer::PushBack(const Span& slice) {
+  size_ += slice.end - slice.begin;
+  if (count_ > 0) {
+    Span& last = slices_[count_ - 1];
+    if (last.block == slice.block && last.end == slice.begin) {
+      // adjacent parts of a block, merged into one slice
+      last.end = slice.end;
+      slice.block->Unref();
+      return;
+    }
+    if (last.begin == last.end) {
+      // the empty block kept for appending is replaced
+      last.block->Unref();
+      last = slice;
+      return;
+    }
+  }
+  Reserve(count_ + 1);
+  slices_[count_++] = slice;
+}
+
+void Buffer::PushFront(const Span& slice) {
+  Reserve(count_ + 1);
+  memmove(slices_ + 1, slices_, count_ * sizeof(Span));
+  slices_[0] = slice;
+  count_++;
+}
+
+void Buffer::PopFront() {
+  count_--;
+  memmove(slices_, slices_ + 1, count_ * sizeof(Span));
+}
+
+void Buffer::Reserve(uint32_t n) {
+  if (n <= capacity_) return;
+  uint32_t capacity = std::max(n, capacity_ * 2);
+  Span* slices = (Span*)malloc(capacity * sizeof(Span));
+  if (slices == NULL) return;
+  memcpy(slices, slices_, count_ * sizeof(Span));
+  if (slices_ != inline_) free(slices_);
+  slices_ = slices;
+  capacity_ = capacity;
+}
+
+}  // evt_loop
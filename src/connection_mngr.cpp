@@ -6,10 +6,10 @@ namespace evt_loop {
 static const uint32_t MIN_TIMEOUT = 30;
 static const uint32_t MIN_TIME_SLICE = 5;
 
-ConnectionManager::ConnectionManager(const ConnectionIdleTimeoutCallback& timeout_cb, uint32_t timeout) :
+ConnectionManager::ConnectionManager(const ConnectionIdleTimeoutCallback& timeout_cb, uint32_t timeout, EventLoop* el) :
     m_timeout(0),
     m_conn_timeout_cb(timeout_cb),
-    m_inactivity_checker(std::bind(&ConnectionManager::OnConnectionInactivityCb, this, std::placeholders::_1))
+    m_inactivity_checker(std::bind(&ConnectionManager::OnConnectionInactivityCb, this, std::placeholders::_1), el)
 {
     uint32_t adj_timeout = (timeout == 0 ? 0 : std::max(timeout, MIN_TIMEOUT));
     SetupInactivityChecker(adj_timeout);
@@ -1,6 +1,12 @@
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 #include "eventloop.h"
 #include "timer_handler.h"
@@ -10,15 +16,19 @@
 
 namespace evt_loop {
 
+// the loop running on the thread, or set by EventLoop::SetCurrent()
+static thread_local EventLoop* t_current_loop = NULL;
+
 time_t Now()
 {
-  return EV_Singleton->UnixTime();
+  return EventLoop::Current()->UnixTime();
 }
 
 int SetNonblocking(int fd) {
   if (fd < 0) return -1;
   int opts;
   if ((opts = fcntl(fd, F_GETFL)) != -1) {
+    if (opts & O_NONBLOCK) return 0;    // e.g. accepted by accept4() with SOCK_NONBLOCK
     opts = opts | O_NONBLOCK;
     if(fcntl(fd, F_SETFL, opts) != -1) {
       return 0;
@@ -27,18 +37,152 @@ int SetNonblocking(int fd) {
   return -1;
 }
 
+// wakes up the loop blocked in the poller when tasks are queued from other threads,
+// it uses eventfd on linux and a pipe on other platforms.
+class LoopWaker : public IOEvent {
+ public:
+  LoopWaker() : IOEvent(), wfd_(-1) {
+#if defined(__linux__)
+    fd_ = wfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    int fds[2];
+    if (pipe(fds) == 0) {
+      fd_ = fds[0];
+      wfd_ = fds[1];
+      SetNonblocking(wfd_);
+    }
+#endif
+    if (fd_ < 0) {
+      printf("[LoopWaker::LoopWaker] create waker failed: %s(errno: %d)\n", strerror(errno), errno);
+    }
+  }
+  ~LoopWaker() {
+    if (wfd_ >= 0 && wfd_ != fd_) close(wfd_);
+    if (fd_ >= 0) close(fd_);
+    fd_ = wfd_ = -1;    // closed here, IOEvent does not know the loop owns it
+  }
+
+  void Notify() {
+    uint64_t one = 1;
+    ssize_t n = write(wfd_, &one, sizeof(one));
+    (void)n;  // the waker is readable already if the write would block
+  }
+
+ protected:
+  void OnEvents(uint32_t events) {
+    uint64_t counter[8];
+    while (read(fd_, counter, sizeof(counter)) > 0) { }
+  }
+
+ private:
+  int wfd_;
+};
+
+#if defined(__linux__)
+// a CLOCK_MONOTONIC timerfd, it wakes up the loop blocked in the poller at the expiration
+// of the nearest timer in nanoseconds, instead of the timeout of the poller in milliseconds.
+class LoopTimer : public IOEvent {
+ public:
+  LoopTimer() : IOEvent(), armed_(false) {
+    fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_ < 0) {
+      printf("[LoopTimer::LoopTimer] create timerfd failed: %s(errno: %d)\n", strerror(errno), errno);
+    }
+  }
+  ~LoopTimer() {
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+  }
+
+  // sets the expiration unless an earlier one is armed, which wakes up the loop to arm it again
+  bool Arm(const TimeVal& expires, const TimeVal& now) {
+    if (armed_ && !(expires < expires_) && now < expires_) return true;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value = expires.TimeSpec();
+    if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+      printf("[LoopTimer::Arm] timerfd_settime failed: %s(errno: %d)\n", strerror(errno), errno);
+      return false;
+    }
+    armed_ = true;
+    expires_ = expires;
+    return true;
+  }
+
+ protected:
+  void OnEvents(uint32_t events) {
+    uint64_t expirations;
+    while (read(fd_, &expirations, sizeof(expirations)) > 0) { }
+    armed_ = false;
+  }
+
+ private:
+  bool    armed_;
+  TimeVal expires_;
+};
+#endif
+
 // EventLoop implementation
 EventLoop::EventLoop() {
-  poller_ = std::make_shared<Poller>();
-  timermanager_ = std::make_shared<TimerManager>();
+  now_.SetMonoNow();
+  unix_time_ = time(NULL);
+  tid_ = pthread_self();
+  poller_ = std::shared_ptr<Poller>(Poller::Create());
+  poller_->SetCompletionCallback(std::bind(&EventLoop::_ProcessCompletion, this,
+              std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+#if defined(USE_TIMER_MAP)
+  timermanager_ = std::make_shared<TimerMapManager>();
+#else
+  timermanager_ = std::make_shared<TimerWheelManager>(now_);
+#endif
   idle_events_ = std::make_shared<UserEventManager>();
   tick_events_ = std::make_shared<UserEventManager>();
-  now_.SetNow();
   running_ = false;
+  wakeup_pending_ = false;
+  stats_enabled_ = true;
+  woken_ = false;
+  internal_events_ = 0;
+  lag_pending_ = false;
+  profiling_ = false;
+  profiler_ = NULL;
+  spin_max_ns_ = 0;
+  spin_window_ns_ = 0;
+  spin_armed_ = false;
+  busy_poll_us_ = 0;
+  busy_poll_warned_ = false;
+  cpu_ = -1;
+  numa_node_ = -1;
+  waker_ = new LoopWaker();
+  if (waker_->fd_ >= 0) AddEvent(waker_);
+  timer_ = NULL;
+  signal_manager_ = NULL;
+#if defined(__linux__)
+  timer_ = new LoopTimer();
+  if (timer_->fd_ >= 0) {
+    AddEvent(timer_);
+  } else {
+    delete timer_;
+    timer_ = NULL;
+  }
+#endif
   signal(SIGPIPE, SIG_IGN);  // Ignore SIGPIPE, this signal will be received when write the socket that closed by peer
 }
 
 EventLoop::~EventLoop() {
+  // the tasks queued before the loop stopped are run, their waiters are not left blocked
+  ProcessPendingTasks();
+  ReleaseGraveyard();   // the objects may delete their events from the loop
+  if (signal_manager_) {
+    if (signal_manager_->fd_ >= 0) DeleteEvent(signal_manager_);
+    delete signal_manager_;
+  }
+  if (timer_) {
+    DeleteEvent(timer_);
+    delete timer_;
+  }
+  if (waker_->fd_ >= 0) DeleteEvent(waker_);
+  delete waker_;
+  delete profiler_;
 }
 
 int EventLoop::ProcessFileEvents(int timeout) {
@@ -46,50 +190,269 @@ int EventLoop::ProcessFileEvents(int timeout) {
               std::placeholders::_1, std::placeholders::_2));
 }
 
-int EventLoop::ProcessTimeoutEvents() {
-  int n = 0;
-  TimerManager::TimerMap& timers_map = timermanager_->timers_;
-  TimerManager::TimerMap::iterator iter = timers_map.begin();
-  while (iter != timers_map.end()) {
-    TimeVal tv = iter->first;
-    //printf("EventLoop::ProcessTimeoutEvents, now: %d, tv: %d\n", now_.Seconds(), tv.Seconds());
-    if (TimeVal::MsDiff(now_, tv) < 0) break;
-    n++;
-    TimerManager::TimerSet events_set = iter->second;
-    TimerManager::TimerSet::iterator iter2;
-    for (iter2 = events_set.begin(); iter2 != events_set.end(); ++iter2) {
-      TimerEvent *e = *iter2;
-      e->OnEvents(TimerEvent::TIMER);
+int EventLoop::ProcessReadyEvents() {
+  // the events marked ready by the handlers called here are left to the next iteration
+  size_t n = ready_list_.size();
+  int processed = 0;
+  for (size_t i = 0; i < n; ++i) {
+    IOEvent* e = ready_list_[i];
+    if (e == NULL) continue;
+    uint32_t events = e->ready_events_;
+    e->ready_events_ = 0;
+    ready_list_[i] = NULL;
+    if (e->fd_ > 0) {
+      CallbackProfiler::Scope scope(ActiveProfiler(), e);
+      e->OnEvents(events);
+      processed++;
     }
-    timers_map.erase(iter);
-    iter = timers_map.begin();
   }
-  return n;
+  ready_list_.erase(ready_list_.begin(), ready_list_.begin() + n);
+  return processed;
+}
+
+void EventLoop::MarkReady(IOEvent *e, uint32_t events) {
+  if (e->ready_events_ == 0) ready_list_.push_back(e);
+  e->ready_events_ |= events;
 }
 
-int EventLoop::ProcessEvents(int timeout) {
-  now_.SetNow();
+int EventLoop::ProcessTimeoutEvents() {
+  return timermanager_->ProcessTimeout(now_);
+}
+
+int EventLoop::ProcessEvents() {
+  now_.SetMonoNow();
+  unix_time_ = time(NULL);
+  TimeVal begin = now_;
+  TimeVal mark = now_;
+  if (stats_enabled_ && lag_pending_ && !(now_ < lag_expires_)) {
+    stats_.loop_lag.Record(TimeVal::NsDiff(now_, lag_expires_));
+    lag_pending_ = false;
+  }
+
   int timeout_events = ProcessTimeoutEvents();
+  if (stats_enabled_ && timeout_events > 0) mark = EndPhase(LoopStats::TIMER, mark, timeout_events);
+
+  // calculates the timeout after the expired timers fired, they may rearm the nearest timers
+  int timeout = CalcNextTimeout();
+  bool spinning = false;
+  if (spin_max_ns_ > 0 && timeout != 0 && spin_armed_) {
+    if (now_ < spin_deadline_) {
+      timeout = 0;
+      spinning = true;
+    } else {
+      // the window ran out without events, spins shorter next time
+      spin_armed_ = false;
+      spin_window_ns_ = std::max(spin_window_ns_ / 2, spin_max_ns_ / 16);
+      stats_.spin_fallbacks++;
+      stats_.spin_window_ns = spin_window_ns_;
+    }
+  }
+  woken_ = false;
+  internal_events_ = 0;
+  // the wake ups of the loop itself, by its timerfd or waker, are not file events
+  int file_events = ProcessFileEvents(timeout) - internal_events_;
+  if (!woken_) now_.SetMonoNow();
+  int64_t wait_ns = TimeVal::NsDiff(now_, mark);
+  if (spinning) {
+    stats_.spin_polls++;
+    stats_.spin_ns += wait_ns;
+    if (woken_) {
+      stats_.spin_hits++;
+      spin_window_ns_ = std::min(spin_window_ns_ * 2, spin_max_ns_);
+      stats_.spin_window_ns = spin_window_ns_;
+    }
+  }
+  if (stats_enabled_) {
+    mark = woken_ ? EndPhase(LoopStats::FILE, now_, file_events) : now_;
+  }
 
-  int file_events = ProcessFileEvents(timeout);
+  int ready_events = ProcessReadyEvents();
+  // the events closed by the I/O handlers, none of the handlers is running now
+  ReleaseGraveyard();
+  if (stats_enabled_ && ready_events > 0) mark = EndPhase(LoopStats::READY, mark, ready_events);
+  file_events += ready_events;
+
+  int task_events = ProcessPendingTasks();
+  if (stats_enabled_ && task_events > 0) mark = EndPhase(LoopStats::TASK, mark, task_events);
 
   int idle_events = 0;
-  if (timeout_events == 0 && file_events == 0) {
+  if (timeout_events == 0 && file_events == 0 && task_events == 0) {
     idle_events = ProcessIdleEvents();
+    if (stats_enabled_ && idle_events > 0) mark = EndPhase(LoopStats::IDLE, mark, idle_events);
   }
 
   int tick_events = ProcessTickEvents();
+  ReleaseGraveyard();     // closed by the timers, tasks ...
+
+  if (spin_max_ns_ > 0 && (timeout_events > 0 || file_events > 0 || task_events > 0)) {
+    // keeps spinning for a window after the last events
+    spin_armed_ = true;
+    spin_deadline_ = now_ + TimeVal::FromNs(spin_window_ns_);
+  }
+
+  if (stats_enabled_) {
+    TimeVal end = tick_events > 0 ? EndPhase(LoopStats::TICK, mark, tick_events) : TimeVal::MonoNow();
+    int64_t iteration_ns = TimeVal::NsDiff(end, begin);
+    int64_t busy_ns = iteration_ns - wait_ns;
+    stats_.iterations++;
+    stats_.wait_ns += wait_ns;
+    stats_.busy_ns += busy_ns;
+    stats_.wait_latency.Record(wait_ns);
+    stats_.busy_latency.Record(busy_ns);
+    stats_.iteration_latency.Record(iteration_ns);
+  }
+
+  return timeout_events + file_events + task_events + idle_events + tick_events;
+}
+
+// records the phase began at the time given, returns the time it ends
+TimeVal EventLoop::EndPhase(int phase, const TimeVal& begin, int events) {
+  TimeVal end = TimeVal::MonoNow();
+  stats_.phase_latency[phase].Record(TimeVal::NsDiff(end, begin));
+  stats_.events[phase] += events;
+  return end;
+}
+
+int EventLoop::ProcessPendingTasks() {
+  // cleared before draining, the tasks queued from now on will wake up the loop again
+  wakeup_pending_ = false;
+
+  int n = 0;
+  Functor task;
+  while (pending_tasks_.Pop(task)) {
+    CallbackProfiler::Scope scope(ActiveProfiler(), "task");
+    task();
+    n++;
+  }
+  return n;
+}
+
+void EventLoop::RunInLoop(const Functor& fn) {
+  if (IsInLoopThread()) {
+    fn();
+  } else {
+    QueueInLoop(fn);
+  }
+}
 
-  return timeout_events + file_events + idle_events + tick_events;
+void EventLoop::QueueInLoop(const Functor& fn) {
+  pending_tasks_.Push(fn);
+  if (!IsInLoopThread()) Wakeup();
+}
+
+void EventLoop::Wakeup() {
+  if (!wakeup_pending_.exchange(true)) {
+    waker_->Notify();
+  }
 }
 
 void EventLoop::_ProcessFileEvents(void* evt, uint32_t events) {
-  IOEvent* e = (IOEvent*)evt;
-  if (e && e->fd_ > 0) {
+  if (!woken_) {
+    // the time after waiting, for the handlers and the statistics
+    woken_ = true;
+    now_.SetMonoNow();
+  }
+  IOEvent* e = Resolve(evt);
+  if (e) {
+    if (e == timer_ || e == waker_) internal_events_++;
+    CallbackProfiler::Scope scope(ActiveProfiler(), e);
     e->OnEvents(events);
   }
 }
 
+void EventLoop::_ProcessCompletion(void* evt, int res, const char* data) {
+  if (!woken_) {
+    woken_ = true;
+    now_.SetMonoNow();
+  }
+  IOEvent* e = Resolve(evt);
+  if (e) {
+    CallbackProfiler::Scope scope(ActiveProfiler(), e);
+    e->OnCompletion(res, data);
+  }
+}
+
+// a handle holds the fd + 1, never NULL, in the low half and the generation in the high half
+static const int       HANDLE_FD_BITS = sizeof(uintptr_t) * 4;
+static const uintptr_t HANDLE_FD_MASK = ((uintptr_t)1 << HANDLE_FD_BITS) - 1;
+
+void* EventLoop::Register(IOEvent* e) {
+  IOEvent** registered = io_events_.Find(e->fd_);
+  if (registered && *registered != e) {
+    // the fd was closed and reused without DeleteEvent() of the former event
+    io_events_.Erase(e->fd_);
+    registered = NULL;
+  }
+  if (!registered) io_events_.Insert(e->fd_, e);
+  return Handle(e);
+}
+
+void* EventLoop::Handle(IOEvent* e) const {
+  IOEvent* const* registered = io_events_.Find(e->fd_);
+  if (registered == NULL || *registered != e) return NULL;
+  uintptr_t gen = io_events_.Generation(e->fd_);
+  return (void*)((gen << HANDLE_FD_BITS) | (((uintptr_t)e->fd_ + 1) & HANDLE_FD_MASK));
+}
+
+IOEvent* EventLoop::Resolve(void* handle) {
+  uintptr_t h = (uintptr_t)handle;
+  int fd = (int)(h & HANDLE_FD_MASK) - 1;
+  IOEvent** e = io_events_.Find(fd);
+  uintptr_t gen = io_events_.Generation(fd);
+  if (e && ((gen << HANDLE_FD_BITS) | (h & HANDLE_FD_MASK)) == h) return *e;
+  stats_.stale_events++;
+  return NULL;
+}
+
+void EventLoop::EnableProfiler(const TimeVal& threshold, const CallbackProfiler::OnSlowCallback& cb)
+{
+  if (profiler_ == NULL) profiler_ = new CallbackProfiler();
+  profiler_->SetThreshold(threshold.Nanoseconds());
+  profiler_->SetSlowCallback(cb);
+  profiling_ = true;
+}
+
+void EventLoop::EnableBusyPoll(const TimeVal& max_spin, uint32_t busy_poll_us)
+{
+  spin_max_ns_ = max_spin.Nanoseconds();
+  spin_window_ns_ = spin_max_ns_;
+  spin_armed_ = false;
+  stats_.spin_window_ns = spin_window_ns_;
+  busy_poll_us_ = busy_poll_us;
+}
+
+void EventLoop::SetupBusyPoll(int fd)
+{
+  if (busy_poll_us_ == 0 || fd < 0) return;
+  int ret = 0;
+#if defined(SO_BUSY_POLL)
+  int usecs = busy_poll_us_;
+  ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+#endif
+#if defined(SO_PREFER_BUSY_POLL)
+  int one = 1;
+  if (ret == 0) ret = setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+  if (ret < 0 && !busy_poll_warned_) {
+    // e.g. EPERM for the time above net.core.busy_read without CAP_NET_ADMIN
+    busy_poll_warned_ = true;
+    printf("[EventLoop::SetupBusyPoll] set busy poll on fd %d failed: %s(errno: %d)\n", fd, strerror(errno), errno);
+  }
+}
+
+int EventLoop::SetCpuAffinity(int cpu)
+{
+  if (!IsInLoopThread()) {
+    printf("[EventLoop::SetCpuAffinity] must be called on the loop thread\n");
+    return -1;
+  }
+  if (SetThreadAffinity(cpu) < 0) return -1;
+  cpu_ = cpu;
+  numa_node_ = NumaNodeOfCpu(cpu);
+  if (numa_node_ >= 0) poller_->SetNumaNode(numa_node_);
+  return 0;
+}
+
 int EventLoop::ProcessIdleEvents()
 {
   return idle_events_->Process();
@@ -100,20 +463,47 @@ int EventLoop::ProcessTickEvents()
   return tick_events_->Process();
 }
 
+void EventLoop::ReleaseGraveyard()
+{
+  if (graveyard_.empty()) return;
+  // swapped out first, the destructors may defer more objects
+  std::vector<std::shared_ptr<void>> graveyard;
+  graveyard.swap(graveyard_);
+}
+
 int EventLoop::CalcNextTimeout()
 {
-    int timeout = 100;
-    if (timermanager_->timers_.size() > 0) {
-      TimerManager::TimerMap::iterator iter = timermanager_->timers_.begin();
-      TimeVal time = iter->first;
-      int t = TimeVal::MsDiff(time, now_);
-      if (t > 0 && timeout > t) timeout = t;
-    }
-    return timeout;
+    // tasks queued on the loop thread, or a push still in progress, do not wait
+    if (!pending_tasks_.Empty()) return 0;
+    // the events with work left to do
+    if (!ready_list_.empty()) return 0;
+
+    TimeVal expires;
+    if (!timermanager_->NextExpiration(expires)) return MAX_WAIT_MS;
+    lag_expires_ = expires;   // for the loop lag, see ProcessEvents()
+    lag_pending_ = true;
+    int64_t ns = TimeVal::NsDiff(expires, now_);
+    if (ns <= 0) return 0;
+    if (ns >= (int64_t)MAX_WAIT_MS * 1000000) return MAX_WAIT_MS;
+
+#if defined(__linux__)
+    if (timer_ && timer_->Arm(expires, now_)) return MAX_WAIT_MS;
+#endif
+    // rounded up, the poller does not return before the expiration
+    return (ns + 999999) / 1000000;
+}
+
+EventLoop* EventLoop::Current() {
+  return t_current_loop ? t_current_loop : EV_Singleton;
+}
+
+void EventLoop::SetCurrent(EventLoop* loop) {
+  t_current_loop = loop;
 }
 
 void EventLoop::StopLoop() {
   running_ = false;
+  if (!IsInLoopThread()) Wakeup();
 }
 
 void EventLoop::StartLoop() {
@@ -122,29 +512,52 @@ void EventLoop::StartLoop() {
     return;
   }
 
+  tid_ = pthread_self();
+  EventLoop* prev = t_current_loop;
+  t_current_loop = this;
   running_ = true;
   while (running_) {
-    now_.SetNow();
-    int timeout = CalcNextTimeout();
-
-    ProcessEvents(timeout);
+    ProcessEvents();
   }
+  t_current_loop = prev;
 }
 
 int EventLoop::AddEvent(IOEvent *e) {
+  if (e->fd_ < 0) return -1;
   e->el_ = this;
   SetNonblocking(e->fd_);
-  return poller_->SetEvents(e->fd_, PollerCtrl::ADD, e->events_, e);
+  return poller_->SetEvents(e->fd_, PollerCtrl::ADD, e->events_, Register(e));
 }
 
 int EventLoop::UpdateEvent(IOEvent *e) {
-  return poller_->SetEvents(e->fd_, PollerCtrl::UPDATE, e->events_, e);
+  if (e->fd_ < 0) return -1;    // bound to the loop but not registered yet
+  // the handle of the registration is kept, the generation of the fd is not changed
+  void* handle = Handle(e);
+  if (handle == NULL) return -1;   // deleted from the loop, or the fd was taken by another event
+  return poller_->SetEvents(e->fd_, PollerCtrl::UPDATE, e->events_, handle);
 }
 
 int EventLoop::DeleteEvent(IOEvent *e) {
+  if (e->ready_events_ != 0) {
+    e->ready_events_ = 0;
+    std::replace(ready_list_.begin(), ready_list_.end(), e, (IOEvent*)NULL);
+  }
+  if (e->fd_ < 0) return -1;
+  // deleted already, e.g. by the close of a connection released later, or the fd was taken by
+  // another event, whose interest is not to be removed
+  IOEvent** registered = io_events_.Find(e->fd_);
+  if (registered == NULL || *registered != e) return -1;
+  io_events_.Erase(e->fd_);   // the handles in flight go stale
   return poller_->SetEvents(e->fd_, PollerCtrl::DELETE, e->events_);
 }
 
+int EventLoop::EnableCompletion(IOEvent *e, PollerCompletion type) {
+  if (e->el_ != this || e->fd_ < 0) return -1;
+  void* handle = Handle(e);
+  if (handle == NULL) return -1;
+  return poller_->SetCompletion(e->fd_, type, handle);
+}
+
 int EventLoop::AddEvent(TimerEvent *e) {
   e->el_ = this;
   return timermanager_->AddEvent(e);
@@ -159,16 +572,25 @@ int EventLoop::DeleteEvent(TimerEvent *e) {
 }
 
 int EventLoop::AddEvent(SignalEvent *e) {
+  if (signal_manager_ == NULL) {
+    signal_manager_ = new SignalManager();
+    if (signal_manager_->fd_ < 0) {
+      delete signal_manager_;
+      signal_manager_ = NULL;
+      return -1;
+    }
+    AddEvent(signal_manager_);
+  }
   e->el_ = this;
-  return SignalManager::Instance()->AddEvent(e);
+  return signal_manager_->AddEvent(e);
 }
 
 int EventLoop::DeleteEvent(SignalEvent *e) {
-  return SignalManager::Instance()->DeleteEvent(e);
+  return signal_manager_ ? signal_manager_->DeleteEvent(e) : -1;
 }
 
 int EventLoop::UpdateEvent(SignalEvent *e) {
-  return SignalManager::Instance()->UpdateEvent(e);
+  return signal_manager_ ? signal_manager_->UpdateEvent(e) : -1;
 }
 
 int EventLoop::AddEvent(IdleEvent *e) {
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "eventloop_group.h"
+
+namespace evt_loop {
+
+static thread_local EventLoopThread* t_current_loop_thread = NULL;
+
+// EventLoopThread implementation
+EventLoopThread::EventLoopThread(uint32_t index) :
+  index_(index), tid_(0), cpu_(-1), loop_(NULL), running_(false), load_(0)
+{
+}
+
+EventLoopThread::~EventLoopThread()
+{
+  Stop();
+}
+
+bool EventLoopThread::Start()
+{
+  if (running_) return true;
+
+  if (pthread_create(&tid_, NULL, ThreadRoutine, this) != 0) {
+    printf("[EventLoopThread::Start] create thread failed: %s(errno: %d)\n", strerror(errno), errno);
+    return false;
+  }
+
+  // waits for the loop is ready to accept tasks
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return loop_ != NULL; });
+  return true;
+}
+
+void EventLoopThread::Stop()
+{
+  if (!running_) return;
+  if (InLoopThread()) {
+    printf("[EventLoopThread::Stop] can not stop loop thread %u on itself\n", index_);
+    return;
+  }
+
+  // queued rather than called directly, in case the loop has not entered StartLoop() yet
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EventLoop* loop = loop_;
+    if (loop) loop->QueueInLoop([loop] { loop->StopLoop(); });
+  }
+  pthread_join(tid_, NULL);
+}
+
+void* EventLoopThread::ThreadRoutine(void* arg)
+{
+  EventLoopThread* self = (EventLoopThread*)arg;
+  self->Run();
+  return NULL;
+}
+
+void EventLoopThread::Run()
+{
+  t_current_loop_thread = this;
+  // pinned before the loop is created, so its memory is first touched on the local node
+  if (cpu_ >= 0 && SetThreadAffinity(cpu_) < 0) {
+    printf("[EventLoopThread::Run] loop thread %u is not pinned to cpu %d\n", index_, cpu_);
+  }
+  // owned by the thread, the events created on it are bound to the loop by EventLoop::Current()
+  std::unique_ptr<EventLoop> loop(new EventLoop);
+  EventLoop::SetCurrent(loop.get());
+  if (cpu_ >= 0) loop->SetCpuAffinity(cpu_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = true;
+    loop_ = loop.get();
+  }
+  cond_.notify_all();
+
+  printf("[EventLoopThread::Run] loop thread %u started, cpu: %d, numa node: %d\n",
+      index_, loop->Cpu(), loop->NumaNode());
+  loop->StartLoop();
+
+  {
+    // Post() drops the tasks from now on, the ones queued before are run by the destructor
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    loop_ = NULL;
+  }
+  printf("[EventLoopThread::Run] loop thread %u exited, poller syscalls saved: %lu\n",
+      index_, (unsigned long)loop->GetPoller()->SyscallsSaved());
+  loop.reset();
+  EventLoop::SetCurrent(NULL);
+  t_current_loop_thread = NULL;
+}
+
+bool EventLoopThread::Post(const Functor& task)
+{
+  // under the lock, so the loop is not destroyed while the task is queued
+  std::lock_guard<std::mutex> lock(mutex_);
+  EventLoop* loop = loop_;
+  if (!loop) {
+    printf("[EventLoopThread::Post] loop thread %u is not running, drop the task\n", index_);
+    return false;
+  }
+  loop->QueueInLoop(task);
+  return true;
+}
+
+void EventLoopThread::PostAndWait(const Functor& task)
+{
+  if (!running_ || InLoopThread()) {
+    task();
+    return;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool done = false;
+  bool posted = Post([&] {
+    task();
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    cond.notify_one();
+  });
+  if (!posted) {
+    task();   // the loop is stopping, run on the caller like a stopped one
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&] { return done; });
+}
+
+EventLoopThread* EventLoopThread::Current()
+{
+  return t_current_loop_thread;
+}
+
+// EventLoopGroup implementation
+EventLoopGroup::EventLoopGroup(uint32_t threads, Policy policy) :
+  policy_(policy), next_(0)
+{
+  for (uint32_t i = 0; i < threads; ++i) {
+    threads_.push_back(new EventLoopThread(i));
+  }
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+  Stop();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    delete threads_[i];
+  }
+  threads_.clear();
+}
+
+bool EventLoopGroup::Start()
+{
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    if (!threads_[i]->Start()) {
+      Stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+void EventLoopGroup::Stop()
+{
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->Stop();
+  }
+}
+
+EventLoopThread* EventLoopGroup::Next()
+{
+  EventLoopThread* selected = NULL;
+  uint32_t n = threads_.size();
+
+  if (policy_ == LEAST_CONNECTIONS) {
+    // starts from the round robin cursor, so the idle loops are used in turn
+    for (uint32_t i = 0; i < n; ++i) {
+      EventLoopThread* t = threads_[(next_ + i) % n];
+      if (t->IsRunning() && (!selected || t->Load() < selected->Load())) {
+        selected = t;
+      }
+    }
+    next_++;
+  } else {
+    for (uint32_t i = 0; i < n && !selected; ++i) {
+      EventLoopThread* t = threads_[next_++ % n];
+      if (t->IsRunning()) selected = t;
+    }
+  }
+  return selected;
+}
+
+void EventLoopGroup::SetCpuAffinity(const std::vector<int>& cpus)
+{
+  if (cpus.empty()) return;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->SetCpu(cpus[i % cpus.size()]);
+  }
+}
+
+EventLoopThread* EventLoopGroup::ForCpu(int cpu) const
+{
+  if (cpu < 0) return NULL;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    EventLoopThread* t = threads_[i];
+    if (t->Cpu() == cpu && t->IsRunning()) return t;
+  }
+  return NULL;
+}
+
+}  // ns evt_loop
@@ -1,8 +1,14 @@
 #include <errno.h>
+#include <limits.h>
 #include "fd_handler.h"
 #include "eventloop.h"
 
-#define MAX_BYTES_RECEIVE       4096
+#define MAX_BYTES_RECEIVE       (64 * 1024)   // the spare buffer of a read
+#ifdef IOV_MAX
+#define MAX_IOVS_SEND           IOV_MAX
+#else
+#define MAX_IOVS_SEND           1024
+#endif
 
 namespace evt_loop
 {
@@ -11,17 +17,17 @@ bool ValidFD(int fd) {
   return fd >= 0;
 }
 
-IOEvent::IOEvent(IOType type, int fd, uint32_t events) :
-  IEvent(events), type_(type), fd_(fd)
+IOEvent::IOEvent(IOType type, int fd, uint32_t events, EventLoop* el) :
+  IEvent(events, el), type_(type), fd_(fd), ready_events_(0)
 {
   if (ValidFD(fd_)) {
-    EV_Singleton->AddEvent(this);
+    Loop()->AddEvent(this);
   }
 }
 IOEvent::~IOEvent() {
   printf("[IOEvent::~IOEvent] addr: %p, type: %d, fd: %d\n", this, type_, fd_);
   if (ValidFD(fd_)) {
-    EV_Singleton->DeleteEvent(this);
+    Loop()->DeleteEvent(this);
     close(fd_);
     fd_ = -1;
   }
@@ -29,18 +35,31 @@ IOEvent::~IOEvent() {
 void IOEvent::SetFD(int fd) {
   if (fd != fd_) {
     if (!ValidFD(fd)) {
-      EV_Singleton->DeleteEvent(this);
+      Loop()->DeleteEvent(this);
       fd_ = fd;
     } else {
       // for update fd
       if (ValidFD(fd_)) {
-        EV_Singleton->DeleteEvent(this);
+        Loop()->DeleteEvent(this);
       }
       fd_ = fd;
-      EV_Singleton->AddEvent(this);
+      Loop()->AddEvent(this);
     }
   }
 }
+int IOEvent::OnReadv(const struct iovec* iov, int iovcnt) {
+  return readv(fd_, iov, iovcnt);
+}
+int IOEvent::OnWritev(const struct iovec* iov, int iovcnt) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+  return sendmsg(fd_, &msg, MSG_NOSIGNAL);
+}
+EventLoop* IOEvent::Loop() const {
+  return el_ ? el_ : EventLoop::Current();
+}
 void IOEvent::WatchEvents(int fd, uint32_t events)
 {
   SetEvents(events);
@@ -53,7 +72,7 @@ void IOEvent::UpdateEvents(uint32_t events)
     if (el_) {
       el_->UpdateEvent(this);
     } else {
-      EV_Singleton->AddEvent(this);
+      Loop()->AddEvent(this);
     }
   }
 }
@@ -101,6 +120,12 @@ void IOEvent::DeleteErrorEvent() {
     el_->UpdateEvent(this);
   }
 }
+void IOEvent::SetEdgeTriggered(bool enable) {
+  uint32_t events = enable ? (events_ | FileEvent::EDGE) : (events_ & ~FileEvent::EDGE);
+  if (events != events_) {
+    UpdateEvents(events);
+  }
+}
 void IOEvent::ClearAllEvents() {
   if (el_) {
     SetEvents(0);
@@ -110,22 +135,42 @@ void IOEvent::ClearAllEvents() {
 
 // BufferIOEvent implementation
 void BufferIOEvent::ClearBuff() {
+  rx_buf_.Clear();
+  if (rx_frame_) rx_frame_->Clear();
+  rx_broken_ = false;
   rx_msg_mq_.Clear();
   tx_msg_mq_.Clear();
+  sent_ = 0;
+  OnTxCleared();
 }
 bool BufferIOEvent::TxBuffEmpty() {
   return tx_msg_mq_.Empty();
 }
 
 int BufferIOEvent::ReceiveData(uint32_t& events) {
-  char buffer[MAX_BYTES_RECEIVE];
+  char spare[MAX_BYTES_RECEIVE];
   int total_rx = 0;
-  while (!rx_msg_mq_.LastCompletion()) {
-    int read_bytes = std::min(rx_msg_mq_.NeedMore(), (size_t)sizeof(buffer));
-    if (read_bytes == 0) break;
+  bool edge = EdgeTriggered();
+  bool more = false;  // stopped by the budget, not drained
+  // the data is received by the poller in completion mode, only the messages left are dispatched.
+  // in edge-triggered mode it reads until the socket is drained, otherwise until a message is completed,
+  // or until some data is received in the view delivery mode, where the messages are parsed by the dispatching.
+  while (!completion_mode_ && (edge || (view_delivery_ ? rx_buf_.Empty() : !rx_msg_mq_.LastCompletion()))) {
+    if (budget_bytes_ > 0 && (uint32_t)total_rx >= budget_bytes_) {
+      more = true;
+      break;
+    }
+    // reads as much as the socket has, into the rest of the receive buffer in place and then
+    // the spare buffer, so all the messages received are taken by one call
+    struct iovec iov[2];
+    iov[0].iov_base = rx_buf_.Prepare(&iov[0].iov_len);
+    iov[1].iov_base = spare;
+    iov[1].iov_len = sizeof(spare);
+    size_t read_bytes = iov[0].iov_len + iov[1].iov_len;
 
-    int len = OnRead(buffer, read_bytes);
-    printf("[BufferIOEvent::ReceiveData] ts: %ld, fd [%d] to read bytes: %d, got: %d\n", Now(), fd_, read_bytes, len);
+    int len = OnReadv(iov, 2);
+    printf("[BufferIOEvent::ReceiveData] ts: %ld, fd [%d] to read bytes: %lu, got: %d\n", Now(), fd_, read_bytes, len);
+    rx_buf_.Commit(len > 0 ? std::min((size_t)len, iov[0].iov_len) : 0);
     if (len < 0) {
       if (errno == EINTR) {
         continue;
@@ -139,28 +184,118 @@ int BufferIOEvent::ReceiveData(uint32_t& events) {
       events |= FileEvent::CLOSED;
       break;
     } else {
-      rx_msg_mq_.AppendData(buffer, len);
+      if ((size_t)len > iov[0].iov_len) {
+        rx_buf_.Append(spare, len - iov[0].iov_len);
+      }
+      AdaptRxBlockSize(len);
+      // splits all the messages completed out of the buffer in one pass
+      if (!view_delivery_ && !rx_msg_mq_.AppendData(rx_buf_)) rx_broken_ = true;
       total_rx += len;
 
       UpdateRxStats(len);
+      if (rx_broken_) break;
+      // the socket is drained by a short read, the poller reports the data arriving later
+      if ((size_t)len < read_bytes) break;
     }
   }
 
-  if (rx_msg_mq_.FirstCompletion()) {
-    MessageMQ::MessageDispatcher processing_msg_cb = std::bind(&BufferIOEvent::OnReceived, this, std::placeholders::_1);
-    rx_msg_mq_.Apply(processing_msg_cb);
+  // the messages completed before the broken one are still delivered
+  if (!DispatchMessages()) more = true;
+  if (rx_broken_) {
+    OnBrokenMessage();
+    events |= FileEvent::CLOSED;
+    return total_rx;
+  }
+  if (more && !(events & (FileEvent::CLOSED | FileEvent::ERROR)) && el_) {
+    el_->MarkReady(this, FileEvent::READ);
   }
   return total_rx;
 }
 
+// the blocks of the receive buffer follow the size of the reads, a large read takes fewer of
+// them, and a small one does not hold a large block
+void BufferIOEvent::AdaptRxBlockSize(size_t rx_bytes) {
+  uint32_t block_size = rx_buf_.BlockSize();
+  if (rx_bytes > block_size && block_size < MAX_RX_BLOCK_SIZE) {
+    rx_buf_.SetBlockSize(block_size * 2);
+  } else if (rx_bytes < block_size / 4 && block_size > MIN_RX_BLOCK_SIZE) {
+    rx_buf_.SetBlockSize(block_size / 2);
+  }
+}
+
+// returns false if some completed messages are left by the budget
+bool BufferIOEvent::DispatchMessages() {
+  if (view_delivery_) return DispatchViews();
+  if (rx_msg_mq_.FirstCompletion()) {
+    // a lambda of this fits in the function, a bind of the member would be allocated
+    MessageMQ::MessageDispatcher processing_msg_cb = [this](const Message* msg) { OnReceived(msg); };
+    rx_msg_mq_.Apply(processing_msg_cb, budget_msgs_);
+    return !rx_msg_mq_.FirstCompletion();
+  }
+  return true;
+}
+
+bool BufferIOEvent::DispatchViews() {
+  if (!rx_frame_ || rx_frame_->Type() != msg_type_) {
+    rx_frame_ = CreateMessage(msg_type_);
+  }
+  MessagePtr frame = rx_frame_;   // kept if OnReceived() resets the message type
+  uint32_t n = 0;
+  while (frame && frame == rx_frame_ && !rx_buf_.Empty()) {
+    if (budget_msgs_ > 0 && n == budget_msgs_) return false;
+    if (frame->AppendData(rx_buf_) == 0 || frame->Broken()) {
+      rx_broken_ = true;  // the message can not take more, e.g. a broken header
+      break;
+    }
+    if (!frame->Completion()) break;   // the rest is to be received
+    OnReceived(frame.get());
+    frame->Clear();
+    n++;
+  }
+  return true;
+}
+
+// the peer sent the data of another protocol or a corrupted one, the rest of the stream can
+// not be framed, so the connection is to be closed instead of dropping the data silently
+void BufferIOEvent::OnBrokenMessage() {
+  printf("[BufferIOEvent::OnBrokenMessage] fd [%d] broken message received, %lu bytes left\n", fd_, rx_buf_.Size());
+  OnError(EBADMSG, strerror(EBADMSG));
+}
+
 int BufferIOEvent::SendData(uint32_t& events) {
+  struct iovec iov[MAX_IOVS_SEND];
   uint32_t cur_sent = 0;
   while (!tx_msg_mq_.Empty()) {
-    const MessagePtr& tx_msg = tx_msg_mq_.First();
-    uint32_t tosend = tx_msg->Size() - sent_;
+    if (budget_bytes_ > 0 && cur_sent >= budget_bytes_) {
+      // WRITE is reported again by a level-triggered poller
+      if (EdgeTriggered() && el_) el_->MarkReady(this, FileEvent::WRITE);
+      break;
+    }
+    // gathers the messages queued into one write, from the part of the first one not sent yet
+    size_t limit = budget_bytes_ > 0 ? budget_bytes_ - cur_sent : (size_t)-1;
+    size_t skip = sent_;
+    size_t tosend = 0;
+    int iovcnt = 0;
+    for (size_t i = 0; i < tx_msg_mq_.Size() && iovcnt < MAX_IOVS_SEND && tosend < limit; ++i) {
+      const Buffer& data = tx_msg_mq_.At(i)->GetBuffer();
+      for (size_t j = 0; j < data.SegmentCount() && iovcnt < MAX_IOVS_SEND && tosend < limit; ++j) {
+        size_t seg_len = 0;
+        const char* seg = data.Segment(j, &seg_len);
+        if (skip >= seg_len) {
+          skip -= seg_len;
+          continue;
+        }
+        seg_len = std::min(seg_len - skip, limit - tosend);
+        iov[iovcnt].iov_base = (void*)(seg + skip);
+        iov[iovcnt].iov_len = seg_len;
+        iovcnt++;
+        tosend += seg_len;
+        skip = 0;
+      }
+    }
 
-    int len = OnWrite(tx_msg->Data().data() + sent_, tosend);
-    printf("[BufferIOEvent::SendData] ts: %ld, fd [%d] to send bytes: %d, sent: %d\n", Now(), fd_, tosend, len);
+    int len = OnWritev(iov, iovcnt);
+    printf("[BufferIOEvent::SendData] ts: %ld, fd [%d] to send bytes: %lu in %d buffers, sent: %d\n", Now(), fd_, tosend, iovcnt, len);
     if (len < 0) {
       if (errno == EINTR) {
         continue;
@@ -173,17 +308,27 @@ int BufferIOEvent::SendData(uint32_t& events) {
     }
 
     UpdateTxStats(len);
-
-    sent_ += len;
     cur_sent += len;
-    if (sent_ == tx_msg->Size()) {
+
+    // the messages sent completely are done in order, the write may end in the middle of one
+    size_t left = len;
+    while (!tx_msg_mq_.Empty()) {
+      const MessagePtr& tx_msg = tx_msg_mq_.First();
+      size_t rest = tx_msg->Size() - sent_;
+      if (left < rest) {
+        sent_ += left;
+        break;
+      }
+      left -= rest;
+      sent_ = 0;
       OnSent(tx_msg.get());
       tx_msg_mq_.EraseFirst();
-      sent_ = 0;
     }
   }
   if (tx_msg_mq_.Empty()) {
-    DeleteWriteEvent();  // All data in the output buffer has been sent, then remove writing event from epoll
+    // All data in the output buffer has been sent, then remove writing event from epoll.
+    // it is kept in edge-triggered mode, where the edge of writable is reported once only.
+    if (!EdgeTriggered()) DeleteWriteEvent();
     if (close_wait_)
       events |= FileEvent::CLOSED;
   }
@@ -191,11 +336,16 @@ int BufferIOEvent::SendData(uint32_t& events) {
 }
 
 void BufferIOEvent::OnEvents(uint32_t events) {
+  if (state_ == CLOSED) return;   // closed by another handler of the iteration
   bool success = false;
   if ((events & FileEvent::WRITE || events & FileEvent::READ) &&
           (state_ == CONNECTED || state_ == HANDSHAKING)) {
     success = OnHandshake();
-    if (!success) events |= FileEvent::CLOSED;
+    if (!success) {
+      events |= FileEvent::CLOSED;
+    } else if (state_ == READY && EdgeTriggered() && el_) {
+      el_->MarkReady(this, events & (FileEvent::READ | FileEvent::WRITE));  // not reported again
+    }
   } else {
     /// The WRITE events should deal with before the READ events
     if (events & FileEvent::WRITE) {
@@ -213,12 +363,53 @@ void BufferIOEvent::OnEvents(uint32_t events) {
   }
 }
 
+bool BufferIOEvent::EnableCompletionMode() {
+  completion_mode_ = el_ && el_->EnableCompletion(this, RECV_MULTISHOT) == 0;
+  return completion_mode_;
+}
+
+void BufferIOEvent::OnCompletion(int res, const char* data) {
+  if (state_ == CLOSED) return;
+  if (state_ == CONNECTED || state_ == HANDSHAKING) {
+    // the data received is kept by the poller no longer than this call
+    if (!OnHandshake()) {
+      OnClosed();
+      return;
+    }
+  }
+
+  if (res > 0) {
+    printf("[BufferIOEvent::OnCompletion] ts: %ld, fd [%d] got: %d\n", Now(), fd_, res);
+    // copied rather than referenced: the ring buffers are a small pool shared by all the
+    // connections of the loop, a partial message or a retained one holding a buffer would
+    // starve the ring and end the multishot recvs with ENOBUFS, and the blocks are released
+    // on any thread while the ring is refilled on the loop thread only. the copy is one
+    // memcpy of BUF_SIZE at most into the tail of the receive buffer, the framing is in place.
+    rx_buf_.Append(data, res);
+    if (!view_delivery_ && !rx_msg_mq_.AppendData(rx_buf_)) rx_broken_ = true;
+    UpdateRxStats(res);
+    bool done = DispatchMessages();
+    if (rx_broken_) {
+      OnBrokenMessage();
+      OnClosed();
+    } else if (!done && el_) {
+      el_->MarkReady(this, FileEvent::READ);
+    }
+  } else if (res == 0) {
+    OnClosed();
+  } else {
+    errno = -res;
+    OnError(errno, strerror(errno));
+  }
+}
+
 bool BufferIOEvent::Send(const Message& msg) {
   MessagePtr msg_ptr = CreateMessage(msg);
   if (msg_ptr) {
 #ifdef _BINARY_MSG_EXTEND_PACKAGING
     if (msg_type_ == MessageType::BINARY) {
       BinaryMessage* bmsg = static_cast<BinaryMessage*>(msg_ptr.get());
+      bmsg->Unshare();  // the data is shared with msg
       bmsg->Header()->msg_id = ++msg_seq_;
     }
 #endif
@@ -272,6 +463,9 @@ bool BufferIOEvent::SendInner(const MessagePtr& msg) {
   if (!(events_ & FileEvent::WRITE)) {
     AddWriteEvent();  // The output buffer has data now, then add writing event to epoll again if epoll has no writing event
   }
+  if (EdgeTriggered() && el_) {
+    el_->MarkReady(this, FileEvent::WRITE);  // the fd may be writable already, no edge to come
+  }
   return true;
 }
 
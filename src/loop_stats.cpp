@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#if defined(__GNUC__)
+#include <cxxabi.h>
+#endif
+#include "loop_stats.h"
+
+namespace evt_loop {
+
+uint32_t LatencyHistogram::BucketIndex(uint64_t ns)
+{
+  if (ns < (uint64_t)SUB_BUCKETS) return (uint32_t)ns;
+  int msb = 63 - __builtin_clzll(ns);
+  if (msb >= MAX_BITS) return BUCKETS - 1;
+  int shift = msb - SUB_BITS;
+  // the values in [2^msb, 2^(msb+1)) take SUB_BUCKETS buckets after the linear ones
+  return (uint32_t)(shift + 1) * SUB_BUCKETS + (uint32_t)((ns >> shift) & (SUB_BUCKETS - 1));
+}
+
+int64_t LatencyHistogram::BucketUpperBound(uint32_t index)
+{
+  if (index < (uint32_t)SUB_BUCKETS) return index;
+  int shift = index / SUB_BUCKETS - 1;
+  int64_t sub = SUB_BUCKETS + index % SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t ns)
+{
+  if (ns < 0) ns = 0;
+  counts_[BucketIndex(ns)]++;
+  count_++;
+  sum_ += ns;
+  if (ns < min_) min_ = ns;
+  if (ns > max_) max_ = ns;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+  if (other.count_ == 0) return;
+  for (uint32_t i = 0; i < BUCKETS; ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  if (other.min_ < min_) min_ = other.min_;
+  if (other.max_ > max_) max_ = other.max_;
+}
+
+void LatencyHistogram::Reset()
+{
+  memset(counts_, 0, sizeof(counts_));
+  count_ = 0;
+  sum_ = 0;
+  min_ = INT64_MAX;
+  max_ = 0;
+}
+
+int64_t LatencyHistogram::Percentile(double percentile) const
+{
+  if (count_ == 0) return 0;
+  uint64_t rank = (uint64_t)(count_ * percentile / 100.0 + 0.5);
+  if (rank == 0) rank = 1;
+  if (rank > count_) rank = count_;
+
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < BUCKETS; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      int64_t bound = BucketUpperBound(i);
+      return bound < max_ ? bound : max_;
+    }
+  }
+  return max_;
+}
+
+const char* LoopStats::PhaseName(int phase)
+{
+  static const char* names[PHASES] = { "timer", "file", "ready", "task", "idle", "tick" };
+  return (phase >= 0 && phase < PHASES) ? names[phase] : "unknown";
+}
+
+void LoopStats::Reset()
+{
+  iterations = 0;
+  wait_ns = 0;
+  busy_ns = 0;
+  stale_events = 0;
+  spin_polls = 0;
+  spin_hits = 0;
+  spin_ns = 0;
+  spin_fallbacks = 0;
+  spin_window_ns = 0;
+  for (int i = 0; i < PHASES; ++i) {
+    events[i] = 0;
+    phase_latency[i].Reset();
+  }
+  iteration_latency.Reset();
+  busy_latency.Reset();
+  wait_latency.Reset();
+  loop_lag.Reset();
+}
+
+void LoopStats::Merge(const LoopStats& other)
+{
+  iterations += other.iterations;
+  wait_ns += other.wait_ns;
+  busy_ns += other.busy_ns;
+  stale_events += other.stale_events;
+  spin_polls += other.spin_polls;
+  spin_hits += other.spin_hits;
+  spin_ns += other.spin_ns;
+  spin_fallbacks += other.spin_fallbacks;
+  if (other.spin_window_ns > spin_window_ns) spin_window_ns = other.spin_window_ns;
+  for (int i = 0; i < PHASES; ++i) {
+    events[i] += other.events[i];
+    phase_latency[i].Merge(other.phase_latency[i]);
+  }
+  iteration_latency.Merge(other.iteration_latency);
+  busy_latency.Merge(other.busy_latency);
+  wait_latency.Merge(other.wait_latency);
+  loop_lag.Merge(other.loop_lag);
+}
+
+static void AppendHistogram(std::string& out, const char* name, const LatencyHistogram& h, const char* extra)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "  %-10s count: %lu, p50: %.1fus, p99: %.1fus, p999: %.1fus, max: %.1fus%s\n",
+           name, (unsigned long)h.Count(), h.Percentile(50) / 1000.0, h.Percentile(99) / 1000.0,
+           h.Percentile(99.9) / 1000.0, h.Max() / 1000.0, extra);
+  out += line;
+}
+
+std::string LoopStats::ToString() const
+{
+  std::string out;
+  char line[256];
+  uint64_t total = wait_ns + busy_ns;
+  snprintf(line, sizeof(line), "iterations: %lu, wait: %.3fs, busy: %.3fs (%.1f%%), stale events: %lu\n",
+           (unsigned long)iterations, wait_ns / 1e9, busy_ns / 1e9, total ? busy_ns * 100.0 / total : 0.0,
+           (unsigned long)stale_events);
+  out += line;
+  if (spin_polls > 0) {
+    snprintf(line, sizeof(line), "spin polls: %lu, hits: %lu (%.1f%%), time: %.3fs, fallbacks: %lu, window: %.1fus\n",
+             (unsigned long)spin_polls, (unsigned long)spin_hits, spin_hits * 100.0 / spin_polls,
+             spin_ns / 1e9, (unsigned long)spin_fallbacks, spin_window_ns / 1000.0);
+    out += line;
+  }
+  AppendHistogram(out, "iteration", iteration_latency, "");
+  AppendHistogram(out, "busy", busy_latency, "");
+  AppendHistogram(out, "wait", wait_latency, "");
+  AppendHistogram(out, "lag", loop_lag, "");
+  for (int i = 0; i < PHASES; ++i) {
+    snprintf(line, sizeof(line), ", events: %lu", (unsigned long)events[i]);
+    AppendHistogram(out, PhaseName(i), phase_latency[i], line);
+  }
+  return out;
+}
+
+static int64_t ClockNs(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void CallbackProfiler::Begin(Scope& scope, const char* key, bool type_name)
+{
+  scope.key_ = key;
+  scope.type_name_ = type_name;
+  scope.cpu_begin_ = ClockNs(CLOCK_THREAD_CPUTIME_ID);
+  scope.wall_begin_ = ClockNs(CLOCK_MONOTONIC);
+}
+
+void CallbackProfiler::End(const Scope& scope)
+{
+  int64_t wall_ns = ClockNs(CLOCK_MONOTONIC) - scope.wall_begin_;
+  int64_t cpu_ns = ClockNs(CLOCK_THREAD_CPUTIME_ID) - scope.cpu_begin_;
+
+  HandlerStats& handler = handlers_[scope.key_];
+  if (handler.calls == 0) {
+    handler.name = scope.key_;
+#if defined(__GNUC__)
+    int status = 0;
+    char* demangled = scope.type_name_ ? abi::__cxa_demangle(scope.key_, NULL, NULL, &status) : NULL;
+    if (demangled) {
+      if (status == 0) handler.name = demangled;
+      free(demangled);
+    }
+#endif
+  }
+  handler.calls++;
+  handler.wall_ns += wall_ns;
+  handler.cpu_ns += cpu_ns;
+  if (wall_ns > handler.max_ns) handler.max_ns = wall_ns;
+
+  if (threshold_ns_ > 0 && wall_ns >= threshold_ns_) {
+    handler.slow_calls++;
+    if (slow_cb_) {
+      slow_cb_(handler, wall_ns, cpu_ns);
+    } else {
+      printf("[CallbackProfiler] slow callback: %s, time: %.3fms, cpu: %.3fms, calls: %lu, slow calls: %lu\n",
+             handler.name.c_str(), wall_ns / 1e6, cpu_ns / 1e6,
+             (unsigned long)handler.calls, (unsigned long)handler.slow_calls);
+    }
+  }
+}
+
+void CallbackProfiler::GetHandlerStats(std::vector<HandlerStats>& stats) const
+{
+  stats.clear();
+  for (auto iter = handlers_.begin(); iter != handlers_.end(); ++iter) {
+    stats.push_back(iter->second);
+  }
+  std::sort(stats.begin(), stats.end(), [](const HandlerStats& lv, const HandlerStats& rv) {
+    return lv.wall_ns > rv.wall_ns;
+  });
+}
+
+}  // ns evt_loop
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <vector>
 #include "message.h"
 
 namespace evt_loop {
@@ -8,11 +10,56 @@ is_visable_char(char c)
     return c >= 0x20 && c <= 0x7e;
 }
 
+size_t Message::AppendData(const char* data, uint32_t length) {
+  if (data == NULL || length == 0 || Completion() || Broken())
+    return 0;
+  size_t feed_size = Scan(data, length);
+  data_.Append(data, feed_size);
+  data_str_valid_ = false;
+  if (Completion()) OnCompleted();
+  return feed_size;
+}
+
+size_t Message::AppendData(Buffer& buf) {
+  size_t feeds = 0;
+  while (!buf.Empty() && !Completion() && !Broken()) {
+    size_t seg_len = 0;
+    const char* seg = buf.Segment(0, &seg_len);
+    size_t feed_size = Scan(seg, seg_len);
+    if (feed_size == 0) break;
+    buf.MoveTo(data_, feed_size);
+    feeds += feed_size;
+    data_str_valid_ = false;
+  }
+  if (feeds > 0 && Completion()) OnCompleted();
+  return feeds;
+}
+
+size_t Message::AssignData(const char* data, uint32_t length, bool has_hdr) {
+  UNUSED(has_hdr);
+  Clear();
+  return AppendData(data, length);
+}
+
+const std::string& Message::Data() const {
+  if (!data_str_valid_) {
+    data_str_.resize(data_.Size());
+    data_.CopyOut(&data_str_[0], 0, data_.Size());
+    data_str_valid_ = true;
+  }
+  return data_str_;
+}
+
+void Message::Unshare() {
+  data_.Unshare();
+  if (Completion()) OnCompleted();
+}
+
 void Message::DumpHex(size_t max_bytes) const {
-  size_t bytes_to_dump = (max_bytes == 0 || max_bytes > data_.size()) ? data_.size() : max_bytes;
+  size_t bytes_to_dump = (max_bytes == 0 || max_bytes > data_.Size()) ? data_.Size() : max_bytes;
   size_t i = 0;
   for (; i < bytes_to_dump; i++) {
-      printf("%02X", data_[i]);
+      printf("%02X", (unsigned char)data_.At(i));
       if (i != 0 && (i + 1) % 16 == 0) printf("\n");
       else printf(" ");
       if (i != 0 && (i + 1) % 8 == 0 && (i + 1) % 16 != 0) printf(" ");
@@ -22,7 +69,7 @@ void Message::DumpHex(size_t max_bytes) const {
 
 void Message::DumpHex(const char* tag, size_t max_bytes) const {
   printf("%s: \n", tag);
-  size_t bytes_to_dump = (max_bytes == 0 || max_bytes > data_.size()) ? data_.size() : max_bytes;
+  size_t bytes_to_dump = (max_bytes == 0 || max_bytes > data_.Size()) ? data_.Size() : max_bytes;
   size_t i = 0;
   size_t j = 0;
   size_t k = 0;
@@ -30,7 +77,7 @@ void Message::DumpHex(const char* tag, size_t max_bytes) const {
   for (; i < bytes_to_dump; i+=j) {
     size_t rest_bytes = bytes_to_dump-i;
     for (j=0; j<rest_bytes && j<LINE_BYTES; j++) {
-      printf("%02X ", data_[i+j]);
+      printf("%02X ", (unsigned char)data_.At(i+j));
     }
     printf("  ");
     if (rest_bytes < LINE_BYTES) {
@@ -40,12 +87,12 @@ void Message::DumpHex(const char* tag, size_t max_bytes) const {
     }
 
     for (k=0; k<rest_bytes && k<LINE_BYTES; k++) {
-      int pos = i+k;
-      if (is_visable_char(data_[pos])) {
-        printf("%c", data_[pos]);
-      } else if (data_[pos] == '\n') {
+      char c = data_.At(i+k);
+      if (is_visable_char(c)) {
+        printf("%c", c);
+      } else if (c == '\n') {
         printf("\\n");
-      } else if (data_[pos] == '\r') {
+      } else if (c == '\r') {
         printf("\\r");
       } else {
         printf(".");
@@ -57,30 +104,23 @@ void Message::DumpHex(const char* tag, size_t max_bytes) const {
 
 const char* CRLFMessage::TERMINAL_LABEL = "\r\n";
 
-size_t CRLFMessage::AppendData(const char* data, uint32_t size) {
-  if (data == NULL || size == 0 || Completion())
-    return 0;
-  // FIXME: should processing the case that "\r\n" was splitted in two data
-  size_t feed_size = size;
-  char* tl_ptr = (char*)strstr(data, TERMINAL_LABEL);
-  if (tl_ptr != NULL) {
-    tl_ptr += 2;
-    feed_size = tl_ptr - data;
+size_t CRLFMessage::Scan(const char* data, size_t size) {
+  // the data is not null-terminated, and "\r\n" may be splitted in two data
+  const char* lf = (const char*)memchr(data, '\n', size);
+  while (lf != NULL) {
+    if ((lf > data && lf[-1] == '\r') ||
+        (lf == data && !data_.Empty() && data_.At(data_.Size() - 1) == '\r')) {
+      completed_ = true;
+      return lf + 1 - data;
+    }
+    lf = (const char*)memchr(lf + 1, '\n', size - (lf + 1 - data));
   }
-  data_.append(data, feed_size);
-  return feed_size;
-}
-size_t CRLFMessage::AssignData(const char* data, uint32_t size, bool has_hdr) {
-  UNUSED(has_hdr);
-  data_.clear();
-  return AppendData(data, size);
+  return size;
 }
 
-size_t JsonMessage::AppendData(const char* data, uint32_t size) {
-  if (data == NULL || size == 0 || Completion())
-    return 0;
+size_t JsonMessage::Scan(const char* data, size_t size) {
   size_t feed_size = size;
-  for (uint32_t i = 0; i < size; i++) {
+  for (size_t i = 0; i < size; i++) {
     if (data[i] == '{') {
       lbc_++;
     } else if (data[i] == '}') {
@@ -91,67 +131,64 @@ size_t JsonMessage::AppendData(const char* data, uint32_t size) {
       break;
     }
   }
-  data_.append(data, feed_size);
   return feed_size;
 }
-size_t JsonMessage::AssignData(const char* data, uint32_t size, bool has_hdr) {
-  UNUSED(has_hdr);
-  data_.clear();
-  lbc_ = rbc_ = 0;
-  return AppendData(data, size);
-}
-  
-BinaryMessage::BinaryMessage(const std::string& data, bool has_hdr) : Message(MessageType::BINARY) {
+
+BinaryMessage::BinaryMessage(const std::string& data, bool has_hdr)
+  : Message(MessageType::BINARY), head_size_(0), hdr_(NULL) {
   AssignData(data.data(), data.size(), has_hdr);
-  ResetHeader();
 }
-BinaryMessage::BinaryMessage(const char* data, uint32_t length, bool has_hdr) : Message(MessageType::BINARY) {
+BinaryMessage::BinaryMessage(const char* data, uint32_t length, bool has_hdr)
+  : Message(MessageType::BINARY), head_size_(0), hdr_(NULL) {
   AssignData(data, length, has_hdr);
-  ResetHeader();
 }
-BinaryMessage::BinaryMessage(const BinaryMessage& other) : Message(MessageType::BINARY) {
-  data_ = other.data_;
-  ResetHeader();
-}
-BinaryMessage& BinaryMessage::operator=(const BinaryMessage& rvalue) {
-  data_ = rvalue.data_;
-  ResetHeader();
-  return *this;
-}
-
-size_t BinaryMessage::AppendData(const char* data, uint32_t length) {
-  if (data == NULL || length == 0) return 0;
-
-  data_.append(data, length);
 
-  if (hdr_ == NULL && data_.size() >= sizeof(HDR)) {
-    hdr_ = (HDR*)data_.data();
-    printf("[BinaryMessage::AppendData] HDR: %s\n", hdr_->ToString().c_str());
-    if (data_.capacity() < hdr_->length) {
-      data_.reserve(hdr_->length);
-      hdr_ = (HDR*)data_.data();
+size_t BinaryMessage::Scan(const char* data, size_t length) {
+  // takes the header first then the rest of the message, the data may hold several messages
+  size_t feed_size = 0;
+  if (head_size_ < sizeof(HDR)) {
+    feed_size = std::min(sizeof(HDR) - head_size_, length);
+    memcpy((char*)&head_ + head_size_, data, feed_size);
+    head_size_ += feed_size;
+    if (head_size_ < sizeof(HDR)) return feed_size;
+    printf("[BinaryMessage::AppendData] HDR: %s\n", head_.ToString().c_str());
+    if (Broken()) {
+      printf("[BinaryMessage::AppendData] broken header, length: %u\n", head_.length);
+      return feed_size;
     }
   }
-  return length;   // FIXME: the return value maybe less than length
+  size_t size = data_.Size() + feed_size;
+  if (head_.length > size) {
+    feed_size += std::min(head_.length - size, length - feed_size);
+  }
+  return feed_size;
+}
+
+void BinaryMessage::OnCompleted() {
+  Message::OnCompleted();
+  hdr_ = (HDR*)data_.Data();
 }
 
 size_t BinaryMessage::AssignData(const char* data, uint32_t length, bool has_hdr) {
+  Clear();
   if (data == NULL || length == 0) return 0;
 
+  data_.Append(data, length);
   if (!has_hdr) {
+    // into the headroom of the data, no copying
     HDR msg_hdr;
     msg_hdr.length = length + sizeof(msg_hdr);
-    data_.reserve(msg_hdr.length);
-    data_.append((char*)&msg_hdr, sizeof(msg_hdr));
+    data_.Prepend((char*)&msg_hdr, sizeof(msg_hdr));
   }
-  data_.append(data, length);
+  ResetHeader();
 
   return length;   // FIXME: the return value maybe less than length
 }
 
 void BinaryMessage::ResetHeader() {
-  if (data_.size() >= sizeof(HDR)) {
-    hdr_ = (HDR*)data_.data();
+  head_size_ = data_.CopyOut((char*)&head_, 0, sizeof(HDR));
+  if (head_size_ == sizeof(HDR)) {
+    OnCompleted();
   }
 }
 
@@ -163,62 +200,124 @@ size_t BinaryMessage::Payload(std::string& payload) const {
 
 size_t BinaryMessage::MoreSize() const {
   size_t more_size = 0;
-  size_t data_size = data_.size();
-  if (data_size < sizeof(HDR)) {
-    more_size = sizeof(HDR) - data_size;
-  } else {
-    more_size = hdr_->length - data_size;
+  size_t data_size = data_.Size();
+  if (head_size_ < sizeof(HDR)) {
+    more_size = sizeof(HDR) - head_size_;
+  } else if (head_.length > data_size) {
+    more_size = head_.length - data_size;
   }
   return more_size;
 }
 
+// free lists of the messages released on the thread, one for each type. a message released
+// on another thread joins the lists of that thread, the messages are allocated one by one, so
+// they are freed by any thread.
+class MessagePool {
+  public:
+  static const size_t DFT_MAX_FREE = 1024;
+
+  static MessagePool* Instance() {
+    static thread_local MessagePool t_pool;
+    return t_destroyed ? NULL : &t_pool;
+  }
+
+  MessagePool() : max_free_(DFT_MAX_FREE) { }
+  ~MessagePool() {
+    SetLimit(0);
+    t_destroyed = true;
+  }
+
+  void SetLimit(size_t max_free) {
+    max_free_ = max_free;
+    for (size_t i = 0; i < TYPES; ++i) {
+      while (free_[i].size() > max_free_) {
+        delete free_[i].back();
+        free_[i].pop_back();
+      }
+    }
+  }
+
+  template<typename T>
+  T* Get(MessageType type) {
+    std::vector<Message*>& list = free_[Index(type)];
+    if (list.empty()) {
+      T* msg = new T();
+      msg->pooled_ = true;
+      return msg;
+    }
+    T* msg = static_cast<T*>(list.back());
+    list.pop_back();
+    return msg;
+  }
+
+  // returns false if the message is to be deleted
+  bool Put(Message* msg) {
+    std::vector<Message*>& list = free_[Index(msg->Type())];
+    if (list.size() >= max_free_) return false;
+    msg->Clear();
+    list.push_back(msg);
+    return true;
+  }
+
+  private:
+  static const size_t TYPES = MessageType::TLV + 1;
+  static size_t Index(MessageType type) { return type < TYPES ? type : 0; }
+
+  static thread_local bool  t_destroyed;   // after the exit of the thread, the messages are deleted
+  size_t                    max_free_;
+  std::vector<Message*>     free_[TYPES];
+};
+
+thread_local bool MessagePool::t_destroyed = false;
+
+void Message::Release(Message* msg) {
+  MessagePool* pool = msg->pooled_ ? MessagePool::Instance() : NULL;
+  if (pool == NULL || !pool->Put(msg)) delete msg;
+}
+
+void SetMessagePoolLimit(size_t max_free) {
+  MessagePool* pool = MessagePool::Instance();
+  if (pool) pool->SetLimit(max_free);
+}
+
+template<typename T>
+static MessagePtr NewMessage(MessageType type) {
+  MessagePool* pool = MessagePool::Instance();
+  return MessagePtr(pool ? pool->Get<T>(type) : new T());
+}
+
 MessagePtr CreateMessage(MessageType msg_type) {
-  MessagePtr msg_ptr;
   switch (msg_type) {
     case MessageType::CRLF:
-      msg_ptr = std::make_shared<CRLFMessage>();
-      break;
+      return NewMessage<CRLFMessage>(msg_type);
     case MessageType::JSON:
-      msg_ptr = std::make_shared<JsonMessage>();
-      break;
+      return NewMessage<JsonMessage>(msg_type);
     case MessageType::BINARY:
-      msg_ptr = std::make_shared<BinaryMessage>();
-      break;
+      return NewMessage<BinaryMessage>(msg_type);
     default:
-      break;
+      return MessagePtr();
   }
-  return msg_ptr;
 }
 
 MessagePtr CreateMessage(MessageType msg_type, const char* data, size_t length, bool bmsg_has_no_hdr) {
-  MessagePtr msg_ptr;
-  switch (msg_type) {
-    case MessageType::CRLF:
-      msg_ptr = std::make_shared<CRLFMessage>(data, length);
-      break;
-    case MessageType::JSON:
-      msg_ptr = std::make_shared<JsonMessage>(data, length);
-      break;
-    case MessageType::BINARY:
-      msg_ptr = std::make_shared<BinaryMessage>(data, length, bmsg_has_no_hdr);
-      break;
-    default:
-      break;
+  MessagePtr msg_ptr = CreateMessage(msg_type);
+  if (msg_ptr) {
+    msg_ptr->AssignData(data, length, bmsg_has_no_hdr);
   }
   return msg_ptr;
 }
 
 MessagePtr CreateMessage(const Message& msg) {
-  MessagePtr msg_ptr;
+  MessagePtr msg_ptr = CreateMessage(msg.Type());
   switch (msg.Type()) {
     case MessageType::CRLF:
-      msg_ptr = std::make_shared<CRLFMessage>(dynamic_cast<const CRLFMessage&>(msg));
+      static_cast<CRLFMessage&>(*msg_ptr) = dynamic_cast<const CRLFMessage&>(msg);
       break;
     case MessageType::JSON:
-      msg_ptr = std::make_shared<JsonMessage>(dynamic_cast<const JsonMessage&>(msg));
+      static_cast<JsonMessage&>(*msg_ptr) = dynamic_cast<const JsonMessage&>(msg);
       break;
     case MessageType::BINARY:
-      msg_ptr = std::make_shared<BinaryMessage>(dynamic_cast<const BinaryMessage&>(msg));
+      static_cast<BinaryMessage&>(*msg_ptr) = dynamic_cast<const BinaryMessage&>(msg);
       break;
     default:
       break;
@@ -226,35 +325,47 @@ MessagePtr CreateMessage(const Message& msg) {
   return msg_ptr;
 }
 
-MessagePtr& MessageMQ::Last() {
-  if (mq_.empty()) {
-    mq_.push(CreateMessage(msg_type_));
-  }
-  return mq_.back();
-}
-MessagePtr& MessageMQ::First() {
-  if (mq_.empty()) {
-    mq_.push(CreateMessage(msg_type_));
-  }
-  return mq_.front();
-}
-void MessageMQ::AppendData(const char* data, uint32_t size) {
+bool MessageMQ::AppendData(const char* data, uint32_t size) {
   size_t feeds = 0;
   while (feeds < size) {
+    if (mq_.empty() || Last()->Completion()) {
+      MessagePtr msg = CreateMessage(msg_type_);
+      if (!msg) return false;   // no message of the type, e.g. UNKNOWN
+      mq_.push_back(msg);
+    }
+    size_t feed_size = Last()->AppendData(&data[feeds], size - feeds);
+    if (feed_size == 0 || Last()->Broken()) return false;
+    feeds += feed_size;
     if (Last()->Completion()) {
-      mq_.push(CreateMessage(msg_type_));
+      printf("[MessageMQ] Recieved a complation message, type: %d, size: %lu\n", Last()->Type(), Last()->Size());
+    }
+  }
+  return true;
+}
+bool MessageMQ::AppendData(Buffer& buf) {
+  while (!buf.Empty()) {
+    if (mq_.empty() || Last()->Completion()) {
+      MessagePtr msg = CreateMessage(msg_type_);
+      if (!msg) return false;   // no message of the type, e.g. UNKNOWN
+      mq_.push_back(msg);
     }
-    feeds += Last()->AppendData(&data[feeds], size - feeds);
+    size_t feed_size = Last()->AppendData(buf);
+    if (feed_size == 0 || Last()->Broken()) return false;
     if (Last()->Completion()) {
       printf("[MessageMQ] Recieved a complation message, type: %d, size: %lu\n", Last()->Type(), Last()->Size());
     }
   }
+  return true;
 }
-void MessageMQ::Apply(MessageDispatcher& cb) {
+size_t MessageMQ::Apply(MessageDispatcher& cb, size_t max_msgs) {
+  size_t n = 0;
   while (!mq_.empty() && mq_.front()->Completion()) {
+    if (max_msgs > 0 && n == max_msgs) break;
     cb(mq_.front().get());
-    mq_.pop();
+    mq_.pop_front();
+    n++;
   }
+  return n;
 }
 
 }  // evt_loop
@@ -1,11 +1,83 @@
-#ifdef USE_SELECT
-    #include "poller_select.cpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "poller.h"
+
+namespace evt_loop {
+
+Poller* Poller::Create(const char* name)
+{
+  if (name == NULL) name = getenv("EL_POLLER");
+#if defined(USE_SELECT)
+  if (name == NULL) name = "select";
+#endif
+  if (name == NULL) name = "";
+
+  if (strcmp(name, "select") == 0) {
+    return new SelectPoller();
+  }
+
+#if defined(__linux__)
+#if defined(HAVE_IO_URING)
+  if (name[0] == '\0' || strcmp(name, "io_uring") == 0) {
+    UringPoller* poller = new UringPoller();
+    if (poller->Init()) return poller;
+    delete poller;
+    printf("Poller: io_uring is not supported by the kernel, fallback to epoll\n");
+  }
+#endif
+  return new EpollPoller();
+#elif defined(__macosx__) || defined(__darwin__) || defined(__APPLE__) || defined(__freebsd__)
+  return new KqueuePoller();
 #else
-    #if defined(__linux__)
-        #include "poller_epoll.cpp"
-    #elif defined(__OSX__) || defined(__DARWIN__) || defined(__APPLE__) || defined(__FREEBSD__)
-        #include "poller_kqueue.cpp"
-    #else
-        #error "platform unsupported"
-    #endif
+  return new SelectPoller();
 #endif
+}
+
+void Poller::DeferUpdate(int fd, uint32_t events, void* userdata)
+{
+  if ((size_t)fd >= interests_.size()) {
+    interests_.resize(fd + 1);
+  }
+  Interest& interest = interests_[fd];
+  interest.events = events;
+  if (userdata != NULL) interest.userdata = userdata;
+  if (interest.dirty) {
+    syscalls_saved_++;   // merged into the update pending
+  } else {
+    interest.dirty = true;
+    update_fds_.push_back(fd);
+  }
+}
+
+void Poller::ResetInterest(int fd, uint32_t events)
+{
+  if ((size_t)fd >= interests_.size()) {
+    if (events == 0) return;
+    interests_.resize(fd + 1);
+  }
+  Interest& interest = interests_[fd];
+  interest.applied = interest.events = events;
+  interest.dirty = false;   // dropped if it is still in update_fds_
+}
+
+void Poller::FlushUpdates()
+{
+  for (size_t i = 0; i < update_fds_.size(); ++i) {
+    int fd = update_fds_[i];
+    Interest& interest = interests_[fd];
+    if (!interest.dirty) continue;
+    interest.dirty = false;
+
+    if (interest.events == interest.applied) {
+      syscalls_saved_++;   // toggled back
+      continue;
+    }
+    if (ApplyUpdate(fd, interest.events, interest.userdata) == 0) {
+      interest.applied = interest.events;
+    }
+  }
+  update_fds_.clear();
+}
+
+}  // ns evt_loop
@@ -1,4 +1,7 @@
-#if defined(__linux__) && !defined(USE_SELECT)
+#if defined(__linux__)
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include "poller.h"
@@ -9,20 +12,22 @@ static uint32_t FromEpollEvents(uint32_t epoll_events);
 static uint32_t ToEpollEvents(uint32_t events);
 static int ToEpollCtrl(PollerCtrl ctrl);
 
-Poller::Poller()
+EpollPoller::EpollPoller()
 {
   printf("Poller: using epoll on linux platform\n");
   pfd_ = epoll_create(MAX_EVENTS);
 }
 
-Poller::~Poller()
+EpollPoller::~EpollPoller()
 {
   close(pfd_);
   pfd_ = -1;
 }
 
-int Poller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
+int EpollPoller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
 {
+  FlushUpdates();
+
   epoll_event evs[MAX_EVENTS];
   int nfds = epoll_wait(pfd_, evs, MAX_EVENTS, wait_ms);
   for (int i = 0; i < nfds; i++) {
@@ -32,9 +37,15 @@ int Poller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
   return nfds;
 }
 
-int Poller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
+int EpollPoller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
 {
   if (fd < 0) return -1;
+  if (ctrl == PollerCtrl::UPDATE) {
+    DeferUpdate(fd, events, userdata);
+    return 0;
+  }
+  ResetInterest(fd, ctrl == PollerCtrl::ADD ? events : 0);
+
   epoll_event ev = {0, {0}};
   int epoll_ctrl = ToEpollCtrl(ctrl);
 
@@ -47,6 +58,18 @@ int Poller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
   return epoll_ctl(pfd_, epoll_ctrl, fd, &ev);
 }
 
+int EpollPoller::ApplyUpdate(int fd, uint32_t events, void* userdata)
+{
+  epoll_event ev = {0, {0}};
+  ev.events = ToEpollEvents(events);
+  ev.data.ptr = userdata;
+  int ret = epoll_ctl(pfd_, EPOLL_CTL_MOD, fd, &ev);
+  if (ret < 0) {
+    printf("[EpollPoller::ApplyUpdate] epoll_ctl fd %d failed: %s(errno: %d)\n", fd, strerror(errno), errno);
+  }
+  return ret;
+}
+
 static uint32_t ToEpollEvents(uint32_t events)
 {
   uint32_t epoll_events = 0;
@@ -54,6 +77,7 @@ static uint32_t ToEpollEvents(uint32_t events)
   if (events & FileEvent::WRITE) epoll_events |= EPOLLOUT;
   if (events & FileEvent::CLOSED) epoll_events |= EPOLLRDHUP;
   if (events & FileEvent::ERROR) epoll_events |= EPOLLHUP | EPOLLERR;
+  if (events & FileEvent::EDGE) epoll_events |= EPOLLET;
   return epoll_events;
 }
 
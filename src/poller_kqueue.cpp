@@ -12,22 +12,24 @@ static void DeleteKqueueEvents(struct kevent* ev[], int n_ev, int fd, uint32_t e
 static void UpdateKqueueEvents(struct kevent* ev[], int n_ev, int fd, uint32_t events, void* userdata);
 static uint32_t FromKqueueEvents(int kqueue_filter, int kqueue_flags);
 
-Poller::Poller()
+KqueuePoller::KqueuePoller()
 {
   pfd_ = kqueue();
 }
 
-Poller::~Poller()
+KqueuePoller::~KqueuePoller()
 {
   close(pfd_);
   pfd_ = -1;
 }
 
-int Poller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
+int KqueuePoller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
 {
   struct timespec timeout;
   timeout.tv_sec = wait_ms / 1000;
   timeout.tv_nsec = (wait_ms % 1000) * 1000 * 1000;
+  FlushUpdates();
+
   struct kevent evs[MAX_EVENTS];
   int nfds = kevent(pfd_, NULL, 0, evs, MAX_EVENTS, &timeout);
   for (int i = 0; i < nfds; i++) {
@@ -37,9 +39,24 @@ int Poller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
   return nfds;
 }
 
-int Poller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
+int KqueuePoller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
 {
   if (fd < 0) return -1;
+  if (ctrl == PollerCtrl::UPDATE) {
+    DeferUpdate(fd, events, userdata);
+    return 0;
+  }
+  ResetInterest(fd, ctrl == PollerCtrl::ADD ? events : 0);
+  return Control(fd, ctrl, events, userdata);
+}
+
+int KqueuePoller::ApplyUpdate(int fd, uint32_t events, void* userdata)
+{
+  return Control(fd, PollerCtrl::UPDATE, events, userdata);
+}
+
+int KqueuePoller::Control(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
+{
   struct kevent ev[EVENT_NUM];
   struct kevent* evp = &ev[0];
   for (int i=0; i < EVENT_NUM; i++) {
@@ -63,10 +80,11 @@ int Poller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
 static void AddKqueueEvents(struct kevent* ev[], int n_ev, int fd, uint32_t events, void* userdata)
 {
   int n = 0;
+  uint16_t flags = EV_ADD | EV_ENABLE | ((events & FileEvent::EDGE) ? EV_CLEAR : 0);
   if (events & FileEvent::READ)
-    EV_SET(ev[n++], fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, userdata);
+    EV_SET(ev[n++], fd, EVFILT_READ, flags, 0, 0, userdata);
   if (events & FileEvent::WRITE)
-    EV_SET(ev[n++], fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, userdata);
+    EV_SET(ev[n++], fd, EVFILT_WRITE, flags, 0, 0, userdata);
 }
 
 static void DeleteKqueueEvents(struct kevent* ev[], int n_ev, int fd, uint32_t events)
@@ -81,13 +99,14 @@ static void DeleteKqueueEvents(struct kevent* ev[], int n_ev, int fd, uint32_t e
 static void UpdateKqueueEvents(struct kevent* ev[], int n_ev, int fd, uint32_t events, void* userdata)
 {
   int n = 0;
+  uint16_t flags = EV_ADD | EV_ENABLE | ((events & FileEvent::EDGE) ? EV_CLEAR : 0);
   if (events & FileEvent::READ)
-    EV_SET(ev[n++], fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, userdata);
+    EV_SET(ev[n++], fd, EVFILT_READ, flags, 0, 0, userdata);
   else
     EV_SET(ev[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
 
   if (events & FileEvent::WRITE)
-    EV_SET(ev[n++], fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, userdata);
+    EV_SET(ev[n++], fd, EVFILT_WRITE, flags, 0, 0, userdata);
   else
     EV_SET(ev[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
 }
@@ -1,4 +1,4 @@
-#if defined(USE_SELECT)
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
@@ -7,9 +7,9 @@
 
 namespace evt_loop {
 
-Poller::Poller()
+SelectPoller::SelectPoller()
 {
-  printf("Poller: using select on linux platform\n");
+  printf("Poller: using select\n");
   m_anfdmax = 0;
   m_fd_set_ri = new fd_set;
   m_fd_set_wi = new fd_set;
@@ -17,13 +17,13 @@ Poller::Poller()
   FD_ZERO(m_fd_set_wi);
 }
 
-Poller::~Poller()
+SelectPoller::~SelectPoller()
 {
   delete m_fd_set_ri;
   delete m_fd_set_wi;
 }
 
-int Poller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
+int SelectPoller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
 {
   int nfds = 0;
   struct timeval tv;
@@ -70,9 +70,9 @@ int Poller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
   return nfds;
 }
 
-int Poller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
+int SelectPoller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
 {
-  assert (("Poller(select): fd >= FD_SETSIZE passed to fd_set-based select backend", fd < FD_SETSIZE));
+  assert (fd < FD_SETSIZE && "Poller(select): fd >= FD_SETSIZE passed to fd_set-based select backend");
   if (fd < 0) return -1;
 
   printf("[Poller::SetEvents] fd: %d, ctrl: %d, events: %d, userdata: %p\n", fd, ctrl, events, userdata);
@@ -111,4 +111,3 @@ int Poller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
 }
 
 }  // namespace evt_loop
-#endif  // USE_SELECT
@@ -0,0 +1,512 @@
+#include "poller.h"
+#include "utils.h"
+#if defined(HAVE_IO_URING)
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+namespace evt_loop {
+
+// user_data of the requests submitted for internal purpose, whose completions are ignored
+static const uint64_t INTERNAL_REQUEST = 1ULL << 63;
+
+// kinds of the requests for a fd, in bits 61-62 of user_data
+enum { OP_POLL = 0, OP_RECV = 1, OP_ACCEPT = 2 };
+
+// the buffer group of the provided-buffer ring
+static const uint16_t BUF_GROUP = 0;
+
+static uint32_t ToPollEvents(uint32_t events);
+static uint32_t FromPollEvents(uint32_t poll_events);
+
+// liburing is not required, the ring is driven by the raw system calls
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params* p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int ring_fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void* arg, size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int ring_fd, uint32_t opcode, const void* arg, uint32_t nr_args)
+{
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// user_data of a request for a fd: kind in bits 61-62, generation in bits 32-60 and fd in
+// the low 32 bits, so a completion of the request canceled or of a reused fd number can be recognized.
+static uint64_t EncodeUserData(int fd, uint32_t op, uint32_t gen)
+{
+  return ((uint64_t)op << 61) | ((uint64_t)(gen & 0x1fffffff) << 32) | (uint32_t)fd;
+}
+
+static int DecodeFD(uint64_t user_data)
+{
+  return (int)(user_data & 0xffffffff);
+}
+
+static uint32_t DecodeOp(uint64_t user_data)
+{
+  return (uint32_t)(user_data >> 61) & 0x3;
+}
+
+static uint32_t NextGen(uint32_t gen)
+{
+  gen = (gen + 1) & 0x1fffffff;
+  return gen ? gen : 1;   // user_data of fd 0 must not be 0, which means not armed
+}
+
+UringPoller::UringPoller() :
+  ring_fd_(-1), features_(0),
+  sq_ring_(NULL), sq_ring_size_(0), sq_head_(NULL), sq_tail_(NULL), sq_mask_(NULL), sq_array_(NULL),
+  sqes_(NULL), sqes_size_(0), sq_pending_(0),
+  cq_ring_(NULL), cq_ring_size_(0), cq_head_(NULL), cq_tail_(NULL), cq_mask_(NULL), cqes_(NULL),
+  buf_ring_(NULL), buf_base_(NULL), buf_tail_(0), buf_ring_state_(0), numa_node_(-1)
+{
+}
+
+UringPoller::~UringPoller()
+{
+  // the buffer ring is unregistered along with the ring
+  if (buf_ring_) munmap(buf_ring_, BUF_COUNT * sizeof(struct io_uring_buf));
+  if (buf_base_) munmap(buf_base_, BUF_COUNT * BUF_SIZE);
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0) close(ring_fd_);
+  ring_fd_ = -1;
+}
+
+bool UringPoller::Init(uint32_t entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = sys_io_uring_setup(entries, &params);
+  if (ring_fd_ < 0) {
+    printf("[UringPoller::Init] io_uring_setup failed: %s(errno: %d)\n", strerror(errno), errno);
+    return false;
+  }
+  features_ = params.features;
+
+  // the timeout of waiting completions is passed by IORING_ENTER_EXT_ARG (linux 5.11)
+  if (!(features_ & IORING_FEAT_EXT_ARG)) {
+    printf("[UringPoller::Init] IORING_FEAT_EXT_ARG is not supported\n");
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (features_ & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size_ > sq_ring_size_) sq_ring_size_ = cq_ring_size_;
+    cq_ring_size_ = sq_ring_size_;
+  }
+
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = NULL;
+    printf("[UringPoller::Init] mmap sq ring failed: %s(errno: %d)\n", strerror(errno), errno);
+    return false;
+  }
+  if (features_ & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = NULL;
+      printf("[UringPoller::Init] mmap cq ring failed: %s(errno: %d)\n", strerror(errno), errno);
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = (struct io_uring_sqe*)mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = NULL;
+    printf("[UringPoller::Init] mmap sqes failed: %s(errno: %d)\n", strerror(errno), errno);
+    return false;
+  }
+
+  char* sq = (char*)sq_ring_;
+  sq_head_  = (uint32_t*)(sq + params.sq_off.head);
+  sq_tail_  = (uint32_t*)(sq + params.sq_off.tail);
+  sq_mask_  = (uint32_t*)(sq + params.sq_off.ring_mask);
+  sq_array_ = (uint32_t*)(sq + params.sq_off.array);
+  char* cq = (char*)cq_ring_;
+  cq_head_  = (uint32_t*)(cq + params.cq_off.head);
+  cq_tail_  = (uint32_t*)(cq + params.cq_off.tail);
+  cq_mask_  = (uint32_t*)(cq + params.cq_off.ring_mask);
+  cqes_     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // sqes are used in the order of the ring, the indirection array is fixed
+  for (uint32_t i = 0; i < params.sq_entries; ++i) {
+    sq_array_[i] = i;
+  }
+
+  printf("Poller: using io_uring on linux platform\n");
+  return true;
+}
+
+struct io_uring_sqe* UringPoller::GetSqe()
+{
+  uint32_t tail = *sq_tail_;
+  uint32_t head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (tail - head > *sq_mask_) {
+    // the submission queue is full, submits what we have
+    Enter(sq_pending_, 0, 0);
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head > *sq_mask_) return NULL;
+  }
+
+  struct io_uring_sqe* sqe = &sqes_[tail & *sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  // the kernel reads the sqes in io_uring_enter() only, it is filled after published
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  sq_pending_++;
+  return sqe;
+}
+
+int UringPoller::Enter(uint32_t to_submit, uint32_t min_complete, uint32_t wait_ms)
+{
+  uint32_t flags = 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  const void* argp = NULL;
+  size_t argsz = 0;
+
+  if (min_complete > 0) {
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (wait_ms % 1000) * 1000 * 1000;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+
+  int ret = sys_io_uring_enter(ring_fd_, to_submit, min_complete, flags, argp, argsz);
+  if (ret < 0 && errno != ETIME && errno != EINTR) {
+    printf("[UringPoller::Enter] io_uring_enter failed: %s(errno: %d)\n", strerror(errno), errno);
+  }
+  sq_pending_ = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  return ret;
+}
+
+void UringPoller::SetNumaNode(int node)
+{
+  numa_node_ = node;
+  BindBufRing();
+}
+
+void UringPoller::BindBufRing()
+{
+  if (numa_node_ < 0 || buf_ring_ == NULL) return;
+  BindMemoryToNode(buf_ring_, BUF_COUNT * sizeof(struct io_uring_buf), numa_node_);
+  BindMemoryToNode(buf_base_, BUF_COUNT * BUF_SIZE, numa_node_);
+}
+
+bool UringPoller::InitBufRing()
+{
+#if defined(IORING_RECV_MULTISHOT)
+  if (buf_ring_state_ != 0) return buf_ring_state_ > 0;
+  buf_ring_state_ = -1;
+
+  size_t ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+  void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void* base = mmap(NULL, BUF_COUNT * BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED || base == MAP_FAILED) {
+    printf("[UringPoller::InitBufRing] mmap failed: %s(errno: %d)\n", strerror(errno), errno);
+    if (ring != MAP_FAILED) munmap(ring, ring_size);
+    if (base != MAP_FAILED) munmap(base, BUF_COUNT * BUF_SIZE);
+    return false;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring;
+  reg.ring_entries = BUF_COUNT;
+  reg.bgid = BUF_GROUP;
+  if (sys_io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    printf("[UringPoller::InitBufRing] register buffer ring failed: %s(errno: %d)\n", strerror(errno), errno);
+    munmap(ring, ring_size);
+    munmap(base, BUF_COUNT * BUF_SIZE);
+    return false;
+  }
+
+  buf_ring_ = (struct io_uring_buf_ring*)ring;
+  buf_base_ = (char*)base;
+  BindBufRing();    // before the pages are touched
+  for (uint32_t bid = 0; bid < BUF_COUNT; ++bid) {
+    RecycleBuffer(bid);
+  }
+  buf_ring_state_ = 1;
+  return true;
+#else
+  buf_ring_state_ = -1;
+  return false;
+#endif
+}
+
+void UringPoller::RecycleBuffer(uint16_t bid)
+{
+  // not by buf_ring_->bufs, the flexible array is placed after an empty struct in c++
+  struct io_uring_buf* buf = (struct io_uring_buf*)buf_ring_ + (buf_tail_ & (BUF_COUNT - 1));
+  buf->addr = (uint64_t)(uintptr_t)(buf_base_ + (size_t)bid * BUF_SIZE);
+  buf->len = BUF_SIZE;
+  buf->bid = bid;
+  buf_tail_++;
+  __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+void UringPoller::Disarm(FdEntry& entry)
+{
+  if (entry.armed) {
+    cancels_.push_back(entry.armed);
+    entry.armed = 0;
+  }
+}
+
+void UringPoller::DisarmMultishot(FdEntry& entry)
+{
+  if (entry.multishot) {
+    cancels_.push_back(entry.multishot);
+    entry.multishot = 0;
+  }
+}
+
+void UringPoller::MarkDirty(int fd, FdEntry& entry)
+{
+  if (!entry.dirty) {
+    entry.dirty = true;
+    dirty_fds_.push_back(fd);
+  }
+}
+
+bool UringPoller::ArmEntry(int fd, FdEntry& entry)
+{
+  // in completion mode reading and its errors are reported by the multishot request
+  uint32_t poll_events = entry.events;
+  if (entry.completion != NO_COMPLETION) poll_events &= ~(FileEvent::READ | FileEvent::ERROR);
+
+  if (!entry.armed && poll_events != 0) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (!sqe) return false;
+    entry.gen = NextGen(entry.gen);
+    entry.armed = EncodeUserData(fd, OP_POLL, entry.gen);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ToPollEvents(poll_events);
+    if (entry.events & FileEvent::EDGE) {
+      sqe->len = IORING_POLL_ADD_MULTI;   // completes on every wakeup of the fd, like EPOLLET
+    }
+    sqe->user_data = entry.armed;
+  }
+
+#if defined(IORING_RECV_MULTISHOT)
+  if (entry.completion != NO_COMPLETION && !entry.multishot && !entry.finished &&
+      (entry.events & FileEvent::READ)) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (!sqe) return false;
+    entry.gen = NextGen(entry.gen);
+    sqe->fd = fd;
+    if (entry.completion == RECV_MULTISHOT) {
+      entry.multishot = EncodeUserData(fd, OP_RECV, entry.gen);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUF_GROUP;
+    } else {
+      entry.multishot = EncodeUserData(fd, OP_ACCEPT, entry.gen);
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    sqe->user_data = entry.multishot;
+  }
+#endif
+  return true;
+}
+
+void UringPoller::FlushChanges()
+{
+  size_t i = 0;
+  for (; i < cancels_.size(); ++i) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (!sqe) break;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = cancels_[i];
+    sqe->user_data = INTERNAL_REQUEST;
+  }
+  cancels_.erase(cancels_.begin(), cancels_.begin() + i);
+
+  for (i = 0; i < dirty_fds_.size(); ++i) {
+    int fd = dirty_fds_[i];
+    if (!ArmEntry(fd, fd_entries_[fd])) break;   // no sqe, the rest is left to the next Poll()
+    fd_entries_[fd].dirty = false;
+  }
+  dirty_fds_.erase(dirty_fds_.begin(), dirty_fds_.begin() + i);
+}
+
+int UringPoller::Poll(uint32_t wait_ms, const PollCallback& poll_cb)
+{
+  FlushChanges();
+
+  uint32_t min_complete = wait_ms > 0 ? 1 : 0;
+  if (*cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    min_complete = 0;   // completions are ready already
+  }
+  if (sq_pending_ > 0 || min_complete > 0) {
+    Enter(sq_pending_, min_complete, wait_ms);
+  }
+
+  int nfds = 0;
+  uint32_t head = *cq_head_;
+  uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+    uint64_t user_data = cqe->user_data;
+    int32_t res = cqe->res;
+    uint32_t flags = cqe->flags;
+    if (user_data & INTERNAL_REQUEST) continue;
+
+    int fd = DecodeFD(user_data);
+    FdEntry* entry = (fd >= 0 && (size_t)fd < fd_entries_.size()) ? &fd_entries_[fd] : NULL;
+
+    if (DecodeOp(user_data) == OP_POLL) {
+      if (!entry || entry->armed != user_data) continue;  // canceled, or the fd number is reused
+      bool rearm = !(flags & IORING_CQE_F_MORE);
+      if (rearm) entry->armed = 0;
+
+      if (res < 0) {
+        if (res == -ECANCELED) {
+          MarkDirty(fd, *entry);
+        } else {
+          printf("[UringPoller::Poll] poll fd %d failed: %s\n", fd, strerror(-res));
+        }
+        continue;
+      }
+
+      // one-shot request, or the multishot one ended, it is rearmed in the next Poll()
+      // unless the interest is deleted
+      if (rearm) MarkDirty(fd, *entry);
+      void* userdata = entry->userdata;
+      poll_cb(userdata, FromPollEvents(res));   // the entry may be invalidated by the callback
+      nfds++;
+      continue;
+    }
+
+    // the completions of multishot recv/accept, a buffer is taken for every received data
+    int bid = (flags & IORING_CQE_F_BUFFER) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    if (!entry || entry->multishot != user_data) {
+      if (bid >= 0) RecycleBuffer(bid);
+      continue;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+      entry->multishot = 0;
+      if (res > 0 || res == -ENOBUFS || res == -ECANCELED) {
+        MarkDirty(fd, *entry);  // ended by the kernel, rearmed when the buffers are recycled
+      } else if (res == -EINVAL) {
+        // multishot recv is not supported by the kernel, falls back to the readiness mode
+        printf("[UringPoller::Poll] multishot request of fd %d is not supported, polling instead\n", fd);
+        entry->completion = NO_COMPLETION;
+        MarkDirty(fd, *entry);
+        continue;
+      } else {
+        entry->finished = true;
+      }
+    }
+    if (res == -ENOBUFS || res == -ECANCELED) continue;
+
+    void* userdata = entry->userdata;
+    const char* data = bid >= 0 ? buf_base_ + (size_t)bid * BUF_SIZE : NULL;
+    if (completion_cb_) completion_cb_(userdata, res, data);
+    if (bid >= 0) RecycleBuffer(bid);
+    nfds++;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+  return nfds;
+}
+
+int UringPoller::SetEvents(int fd, PollerCtrl ctrl, uint32_t events, void* userdata)
+{
+  if (fd < 0) return -1;
+  if ((size_t)fd >= fd_entries_.size()) {
+    fd_entries_.resize(fd + 1);
+  }
+  FdEntry& entry = fd_entries_[fd];
+
+  if (ctrl == PollerCtrl::DELETE || ctrl == PollerCtrl::ADD) {
+    // a new registration of the fd number starts in the readiness mode
+    Disarm(entry);
+    DisarmMultishot(entry);
+    entry.completion = NO_COMPLETION;
+    entry.finished = false;
+    if (ctrl == PollerCtrl::DELETE) {
+      entry.events = 0;
+      entry.userdata = NULL;
+      return 0;
+    }
+  } else if (entry.events != events) {
+    Disarm(entry);
+    if (!(events & FileEvent::READ)) DisarmMultishot(entry);
+  }
+
+  if (userdata != NULL) entry.userdata = userdata;
+  entry.events = events;
+  MarkDirty(fd, entry);
+  return 0;
+}
+
+int UringPoller::SetCompletion(int fd, PollerCompletion type, void* userdata)
+{
+#if defined(IORING_RECV_MULTISHOT)
+  if (fd < 0 || (size_t)fd >= fd_entries_.size()) return -1;
+  if (type == RECV_MULTISHOT && !InitBufRing()) return -1;
+
+  FdEntry& entry = fd_entries_[fd];
+  Disarm(entry);    // the polling events change
+  DisarmMultishot(entry);
+  entry.completion = type;
+  entry.finished = false;
+  if (userdata != NULL) entry.userdata = userdata;
+  MarkDirty(fd, entry);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+static uint32_t ToPollEvents(uint32_t events)
+{
+  uint32_t poll_events = 0;
+  if (events & FileEvent::READ) poll_events |= POLLIN;
+  if (events & FileEvent::WRITE) poll_events |= POLLOUT;
+  if (events & FileEvent::CLOSED) poll_events |= POLLRDHUP;
+  if (events & FileEvent::ERROR) poll_events |= POLLHUP | POLLERR;
+  return poll_events;
+}
+
+static uint32_t FromPollEvents(uint32_t poll_events)
+{
+  uint32_t events = 0;
+  if (poll_events & (POLLIN | POLLPRI)) events |= FileEvent::READ;
+  if (poll_events & POLLOUT) events |= FileEvent::WRITE;
+  if (poll_events & POLLRDHUP) events |= FileEvent::CLOSED;
+  if (poll_events & (POLLHUP | POLLERR | POLLNVAL)) events |= FileEvent::ERROR;
+  return events;
+}
+
+}  // namespace evt_loop
+#endif  // HAVE_IO_URING
@@ -2,9 +2,9 @@
 
 namespace evt_loop {
 
-TimeoutSessionManager::TimeoutSessionManager(uint32_t timeout) :
+TimeoutSessionManager::TimeoutSessionManager(uint32_t timeout, EventLoop* el) :
     m_timeout(0),
-    m_timeout_checker(std::bind(&TimeoutSessionManager::CheckSessionTimeoutCb, this, std::placeholders::_1))
+    m_timeout_checker(std::bind(&TimeoutSessionManager::CheckSessionTimeoutCb, this, std::placeholders::_1), el)
 {
     SetupTimeoutChecker(timeout);
 }
@@ -1,55 +1,233 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mutex>
+#include <vector>
+#if defined(__linux__)
+#include <sys/signalfd.h>
+#endif
 #include "signal_handler.h"
+#include "eventloop.h"
 
 namespace evt_loop
 {
 
-SignalManager *SignalManager::instance_ = NULL;
+#if defined(__linux__)
+// the loop thread a signal caught by another thread is forwarded to, see ForwardSignal()
+static pthread_t sig_owners_[NSIG];
+static volatile sig_atomic_t sig_owned_[NSIG];
 
-void HandleSignal(int signo) {
-  std::set<SignalEvent *> events = SignalManager::Instance()->sig_events_[signo];
-  for (std::set<SignalEvent *>::iterator iter = events.begin(); iter != events.end(); ++iter) {
-    (*iter)->OnEvents(signo);
+// the signal is caught by a thread not blocking it, e.g. a thread started before the
+// SignalEvent was added. it is sent to the loop thread, where it is pending for the signalfd.
+static void ForwardSignal(int signo) {
+  if (signo > 0 && signo < NSIG && sig_owned_[signo]) {
+    pthread_kill(sig_owners_[signo], signo);
   }
 }
+#else
+static int sig_pipes_[NSIG];   // the write end of the pipe of the manager forwarded to
 
-int SignalManager::AddEvent(SignalEvent *e) {
-  auto& sig_hdlr_set = sig_events_[e->Signal()];
-  if (sig_hdlr_set.empty()) {
+static void ForwardSignal(int signo) {
+  if (signo > 0 && signo < NSIG && sig_pipes_[signo] > 0) {
+    int saved_errno = errno;
+    unsigned char c = (unsigned char)signo;
+    ssize_t n = write(sig_pipes_[signo], &c, 1);
+    (void)n;  // dropped if the pipe is full, the signals pending are enough to wake up the loop
+    errno = saved_errno;
+  }
+}
+#endif
+
+// the managers watching each signal, of the loops of the process. the disposition of a
+// signal is process-wide, it is set by the first watcher and restored by the last one.
+struct SignalWatcher {
+  const SignalManager* manager;
+  pthread_t thread;
+  int       wfd;
+};
+static std::mutex sig_mutex_;
+static std::vector<SignalWatcher> sig_watchers_[NSIG];
+
+// the signal is forwarded to the latest watcher, caller holds sig_mutex_
+static void UpdateForwarding(int signo) {
+  const std::vector<SignalWatcher>& watchers = sig_watchers_[signo];
+#if defined(__linux__)
+  sig_owned_[signo] = 0;
+  if (!watchers.empty()) {
+    sig_owners_[signo] = watchers.back().thread;
+    sig_owned_[signo] = 1;
+  }
+#else
+  sig_pipes_[signo] = watchers.empty() ? 0 : watchers.back().wfd;
+#endif
+}
+
+SignalManager::SignalManager() : IOEvent(), wfd_(-1)
+{
+  sigemptyset(&mask_);
+#if defined(__linux__)
+  fd_ = signalfd(-1, &mask_, SFD_NONBLOCK | SFD_CLOEXEC);
+#else
+  int fds[2];
+  if (pipe(fds) == 0) {
+    fd_ = fds[0];
+    wfd_ = fds[1];
+    SetNonblocking(wfd_);
+  }
+#endif
+  if (fd_ < 0) {
+    printf("[SignalManager::SignalManager] create signal fd failed: %s(errno: %d)\n", strerror(errno), errno);
+  }
+}
+
+SignalManager::~SignalManager()
+{
+  for (auto iter = sig_events_.begin(); iter != sig_events_.end(); ++iter) {
+    if (!iter->second.empty()) Unwatch(iter->first);
+  }
+  if (wfd_ >= 0) close(wfd_);
+  if (fd_ >= 0) close(fd_);
+  fd_ = wfd_ = -1;    // closed here, the loop deletes the event before
+}
+
+bool SignalManager::Watch(int signo)
+{
+  if (signo <= 0 || signo >= NSIG) return false;
+  sigaddset(&mask_, signo);
+#if defined(__linux__)
+  // blocked before the handler is set, so the loop thread never runs it
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  if (signalfd(fd_, &mask_, 0) < 0) {
+    printf("[SignalManager::Watch] signalfd failed: %s(errno: %d)\n", strerror(errno), errno);
+    sigdelset(&mask_, signo);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    return false;
+  }
+#endif
+
+  std::lock_guard<std::mutex> lock(sig_mutex_);
+  std::vector<SignalWatcher>& watchers = sig_watchers_[signo];
+  SignalWatcher watcher = { this, pthread_self(), wfd_ };
+  watchers.push_back(watcher);
+  UpdateForwarding(signo);
+  if (watchers.size() == 1) {
     struct sigaction action;
-    action.sa_handler = HandleSignal;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = ForwardSignal;
     action.sa_flags = SA_RESTART;
     sigemptyset(&action.sa_mask);
-    sigaction(e->Signal(), &action, NULL);
+    sigaction(signo, &action, NULL);
   }
-  sig_hdlr_set.insert(e);
+  return true;
+}
+
+void SignalManager::Unwatch(int signo)
+{
+  {
+    std::lock_guard<std::mutex> lock(sig_mutex_);
+    std::vector<SignalWatcher>& watchers = sig_watchers_[signo];
+    for (auto iter = watchers.begin(); iter != watchers.end(); ++iter) {
+      if (iter->manager == this) {
+        watchers.erase(iter);
+        break;
+      }
+    }
+    if (watchers.empty()) {
+      // the last watcher of the process, the other loops may still have it in their masks
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = SIG_DFL;
+      sigemptyset(&action.sa_mask);
+      sigaction(signo, &action, NULL);
+    }
+    UpdateForwarding(signo);
+  }
+
+  sigdelset(&mask_, signo);
+#if defined(__linux__)
+  signalfd(fd_, &mask_, 0);
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+#endif
+}
 
+void SignalManager::OnEvents(uint32_t events)
+{
+  int signos[BATCH];
+  int count = 0;
+  for (;;) {
+#if defined(__linux__)
+    struct signalfd_siginfo infos[BATCH];
+    ssize_t n = read(fd_, infos, sizeof(infos));
+    if (n <= 0) break;
+    count = n / sizeof(infos[0]);
+    for (int i = 0; i < count; ++i) signos[i] = infos[i].ssi_signo;
+#else
+    unsigned char bytes[BATCH];
+    ssize_t n = read(fd_, bytes, sizeof(bytes));
+    if (n <= 0) break;
+    count = n;
+    for (int i = 0; i < count; ++i) signos[i] = bytes[i];
+#endif
+    for (int i = 0; i < count; ++i) Dispatch(signos[i]);
+    if (count < BATCH) break;
+  }
+}
+
+void SignalManager::Dispatch(int signo)
+{
+  auto iter = sig_events_.find(signo);
+  if (iter == sig_events_.end()) return;
+  // the handlers may add or delete the events
+  std::set<SignalEvent *> events = iter->second;
+  for (auto e = events.begin(); e != events.end(); ++e) {
+    auto& current = sig_events_[signo];
+    if (current.find(*e) != current.end()) {
+      (*e)->OnEvents(signo);
+    }
+  }
+}
+
+int SignalManager::AddEvent(SignalEvent *e) {
+  auto& sig_hdlr_set = sig_events_[e->Signal()];
+  if (sig_hdlr_set.empty() && !Watch(e->Signal())) {
+    return -1;
+  }
+  sig_hdlr_set.insert(e);
   return 0;
 }
 
 int SignalManager::DeleteEvent(SignalEvent *e) {
-  auto& sig_hdlr_set = sig_events_[e->Signal()];
-  sig_hdlr_set.erase(e);
-  if (sig_hdlr_set.empty()) {
-    sigaction(e->Signal(), NULL, NULL);
+  auto iter = sig_events_.find(e->Signal());
+  if (iter == sig_events_.end() || iter->second.erase(e) == 0) return -1;
+  if (iter->second.empty()) {
+    Unwatch(e->Signal());
   }
   return 0;
 }
 
 int SignalManager::UpdateEvent(SignalEvent *e) {
-  /*
-  // FIXME: below has no effect
-  sig_events_[e->Signal()].erase(e);
-  sig_events_[e->Signal()].insert(e);
-  */
-  return 0;
+  // the signal may be changed by SetSignal() after added
+  for (auto iter = sig_events_.begin(); iter != sig_events_.end(); ++iter) {
+    if (iter->second.erase(e) > 0 && iter->second.empty()) {
+      Unwatch(iter->first);
+    }
+  }
+  return AddEvent(e);
 }
 
-SignalHandler::SignalHandler(SIGNO signo, const OnSignalCallback& cb) :
+SignalHandler::SignalHandler(SIGNO signo, const OnSignalCallback& cb, EventLoop* el) :
     SignalEvent(signo), signal_cb_(cb) {
-  SignalManager::Instance()->AddEvent(this);
+  (el ? el : EventLoop::Current())->AddEvent(this);
 }
 SignalHandler::~SignalHandler() {
-  SignalManager::Instance()->DeleteEvent(this);
+  if (el_) el_->DeleteEvent(this);
 }
 
 }  // namespace evt_loop
@@ -35,10 +35,11 @@ bool SetTcpKeepAlive(int fd, bool enable, int idle, int interval, int count)
     return true;
 }
 
-TcpClient::TcpClient(const char *host, uint16_t port, MessageType msg_type, bool auto_reconnect, TcpCallbacksPtr tcp_evt_cbs)
-    : IOEvent(IOType::TCP_CLIENT),
+TcpClient::TcpClient(const char *host, uint16_t port, MessageType msg_type, bool auto_reconnect, TcpCallbacksPtr tcp_evt_cbs,
+        EventLoop* el)
+    : IOEvent(IOType::TCP_CLIENT, -1, FileEvent::READ | FileEvent::ERROR, el),
     msg_type_(msg_type), keepalive_(false), auto_reconnect_(auto_reconnect), conn_(nullptr),
-    reconnect_timer_(std::bind(&TcpClient::OnReconnectTimer, this, std::placeholders::_1)),
+    reconnect_timer_(std::bind(&TcpClient::OnReconnectTimer, this, std::placeholders::_1), el),
     tcp_evt_cbs_(tcp_evt_cbs)
 {
     InitAddress(host, port);
@@ -141,6 +142,7 @@ void TcpClient::OnConnected(int fd, const IPAddress& local_addr)
     conn_ = CreateClient(fd, local_addr, server_addr_, server_addr_);
     conn_->SetMessageType(msg_type_);
     conn_->AsClient();
+    if (name_) conn_->SetName(name_);
     conn_->SetReadyCallback(std::bind(&TcpClient::OnReady, this, std::placeholders::_1));
     if (hb_tmp_params_) {
         conn_->EnableHeartbeat(hb_tmp_params_->idle_interval, hb_tmp_params_->ping_interval, hb_tmp_params_->ping_total);
@@ -153,7 +155,8 @@ void TcpClient::OnConnected(int fd, const IPAddress& local_addr)
 
 void TcpClient::OnConnectionClosed(TcpConnection* conn)
 {
-    //delete conn_;
+    // it is still running the callback, released by the loop after the handlers return
+    if (conn_) conn_->GetLoop()->DeferRelease(conn_);
     conn_ = nullptr;
     if (auto_reconnect_) {
         Reconnect();
@@ -239,7 +242,7 @@ void TcpClient::OnReconnectTimer(TimerEvent* timer)
 ///////////////////////////////////////////////
 
 TcpClient6::TcpClient6(const char *host, uint16_t port, MessageType msg_type, bool auto_reconnect,
-        TcpCallbacksPtr tcp_evt_cbs) : TcpClient(host, port, msg_type, auto_reconnect, tcp_evt_cbs)
+        TcpCallbacksPtr tcp_evt_cbs, EventLoop* el) : TcpClient(host, port, msg_type, auto_reconnect, tcp_evt_cbs, el)
 {
     /*
     InitAddress(host, port);
@@ -6,11 +6,13 @@
 namespace evt_loop {
 
 TcpConnection::TcpConnection(int fd, const IPAddress& local_addr, const IPAddress& peer_addr, const IPAddress& peer_real_addr,
-    const OnClosedCallback& close_cb, TcpCallbacksPtr tcp_evt_cbs) :
-  BufferIOEvent(IOType::TCP_CONNECTION, fd), id_(0), client_type_(0), local_addr_(local_addr), peer_addr_(peer_addr), peer_real_addr_(peer_real_addr),
+    const OnClosedCallback& close_cb, TcpCallbacksPtr tcp_evt_cbs, EventLoop* el) :
+  BufferIOEvent(IOType::TCP_CONNECTION, fd, FileEvent::READ | FileEvent::WRITE | FileEvent::ERROR, el), id_(0), client_type_(0), local_addr_(local_addr), peer_addr_(peer_addr), peer_real_addr_(peer_real_addr),
   active_closing_(false), is_client_(false), creator_notification_cb_(close_cb), tcp_evt_cbs_(tcp_evt_cbs),
   heartbeat_handler_(this), checking_idle_timer_(nullptr)
 {
+    if (el_) el_->SetupBusyPoll(fd_);
+    EnableViewDelivery(tcp_evt_cbs_ && tcp_evt_cbs_->on_msg_view_recvd_cb);
     printf("[TcpConnection::TcpConnection] local_addr: %s, peer_addr: %s, peer_real_addr: %s\n",
         local_addr_.ToString().c_str(), peer_addr_.ToString().c_str(), peer_real_addr_.ToString().c_str());
 }
@@ -28,6 +30,8 @@ void TcpConnection::Destroy()
     DisableIdleTimeout();
     DisableHeartbeat();
     id_ = 0;
+    // the idle timeout callback may be closing the connection, the timer is released after it
+    if (checking_idle_timer_ && el_) el_->DeferRelease(checking_idle_timer_);
     checking_idle_timer_ = nullptr;
 }
 
@@ -49,7 +53,7 @@ void TcpConnection::EnableIdleTimeout(uint32_t seconds, const OnIdleTimeoutCallb
     DisableIdleTimeout();
 
     TimeVal tv(seconds, 0);
-    checking_idle_timer_ = std::make_shared<PeriodicTimer>(tv, std::bind(&TcpConnection::OnIdleTimeout, this, std::placeholders::_1));
+    checking_idle_timer_ = std::make_shared<PeriodicTimer>(tv, std::bind(&TcpConnection::OnIdleTimeout, this, std::placeholders::_1), el_);
     checking_idle_timer_->Start();
 }
 void TcpConnection::DisableIdleTimeout()
@@ -89,9 +93,12 @@ void TcpConnection::OnReceived(const Message* msg)
     } else if (heartbeat_handler_.IsHeartbeatResponse(msg)) {
         heartbeat_handler_.OnHeartbeatResponseReceived(msg);
     } else if (tcp_evt_cbs_) {
-        if (state_ >= CLOSED && state_ < COUNT)     // Guard condition
+        if (state_ > CLOSED && state_ < COUNT)      // Guard condition
         {
-            tcp_evt_cbs_->on_msg_recvd_cb(this, msg);
+            if (tcp_evt_cbs_->on_msg_view_recvd_cb)
+                tcp_evt_cbs_->on_msg_view_recvd_cb(this, MessageView(*msg));
+            else
+                tcp_evt_cbs_->on_msg_recvd_cb(this, msg);
         }
         else
         {
@@ -116,6 +123,9 @@ void TcpConnection::OnClosed()
     printf("[TcpConnection::OnClosed] fd: %d, state: %d, active_closing: %d\n", fd_, state_, active_closing_);
     if (state_ == CLOSED || state_ >= COUNT) return;    // Invalid connection
 
+    // deregistered at once, the events of the fd queued in this iteration go stale. the
+    // connection itself may be released after the handlers return.
+    if (el_) el_->DeleteEvent(this);
     if (active_closing_) {
         creator_notification_cb_(this);  // NOTE: acitve closing mode, MUST run this line before Destroy()
         Destroy();
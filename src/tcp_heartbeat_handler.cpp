@@ -27,17 +27,22 @@ void PrintMessage(const Message* msg)
     if (msg->Type() == MessageType::BINARY) {
         msg->DumpHex();
     } else {
-        printf("%s\n", msg->Data().c_str());
+        printf("%.*s\n", (int)msg->Size(), msg->Bytes());
     }
 
 }
 
+static bool IsMessageData(const Message* msg, const string& data)
+{
+    return msg->Size() == data.size() && !memcmp(msg->Bytes(), data.data(), data.size());
+}
+
 TcpHeartbeatHandler::HeartbeatPing::HeartbeatPing(TcpHeartbeatHandler* hb_hdlr,
         uint32_t idle_interval, uint32_t ping_interval, uint32_t ping_total) :
     hb_hdlr_(hb_hdlr),
     m_idle_interval(idle_interval), m_ping_interval(ping_interval), m_ping_total(ping_total), m_ping_count(0),
-    m_idle_timer(std::bind(&HeartbeatPing::OnIdleTimer, this, std::placeholders::_1)),
-    m_ping_timer(std::bind(&HeartbeatPing::OnPingTimer, this, std::placeholders::_1))
+    m_idle_timer(std::bind(&HeartbeatPing::OnIdleTimer, this, std::placeholders::_1), hb_hdlr->m_connection->GetLoop()),
+    m_ping_timer(std::bind(&HeartbeatPing::OnPingTimer, this, std::placeholders::_1), hb_hdlr->m_connection->GetLoop())
 {
     TimeVal tv(m_idle_interval, 0);
     m_idle_timer.SetInterval(tv);
@@ -142,34 +147,34 @@ bool TcpHeartbeatHandler::IsHeartbeatResponse(const Message* msg)
 
 bool TcpHeartbeatHandler::IsBinaryHeartbeatRequest(const Message* msg)
 {
-    const DefaultBinaryHeartbeatMessage* hb_msg = (const DefaultBinaryHeartbeatMessage*)(msg->Data().data());
+    const DefaultBinaryHeartbeatMessage* hb_msg = (const DefaultBinaryHeartbeatMessage*)(msg->Bytes());
     return hb_msg->magic == BINARY_HEARTBEAT_REQUEST_MAGIC;
 }
 
 bool TcpHeartbeatHandler::IsJsonHeartbeatRequest(const Message* msg)
 {
-    return msg->Data() == dft_json_heartbeat_request;
+    return IsMessageData(msg, dft_json_heartbeat_request);
 }
 
 bool TcpHeartbeatHandler::IsCRLFHeartbeatRequest(const Message* msg)
 {
-    return msg->Data() == dft_crlf_heartbeat_request;
+    return IsMessageData(msg, dft_crlf_heartbeat_request);
 }
 
 bool TcpHeartbeatHandler::IsBinaryHeartbeatResponse(const Message* msg)
 {
-    DefaultBinaryHeartbeatMessage* hb_msg = (DefaultBinaryHeartbeatMessage*)(msg->Data().data());
+    const DefaultBinaryHeartbeatMessage* hb_msg = (const DefaultBinaryHeartbeatMessage*)(msg->Bytes());
     return hb_msg->magic == BINARY_HEARTBEAT_RESPONSE_MAGIC;
 }
 
 bool TcpHeartbeatHandler::IsJsonHeartbeatResponse(const Message* msg)
 {
-    return msg->Data() == dft_json_heartbeat_response;
+    return IsMessageData(msg, dft_json_heartbeat_response);
 }
 
 bool TcpHeartbeatHandler::IsCRLFHeartbeatResponse(const Message* msg)
 {
-    return msg->Data() == dft_crlf_heartbeat_response;
+    return IsMessageData(msg, dft_crlf_heartbeat_response);
 }
 
 void TcpHeartbeatHandler::OnHeartbeatRequestReceived(const Message* msg)
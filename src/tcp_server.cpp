@@ -2,13 +2,40 @@
 #include "tcp_server.h"
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
 
 namespace evt_loop {
 
-TcpServer::TcpServer(const char *host, uint16_t port, MessageType msg_type, TcpCallbacksPtr tcp_evt_cbs)
-    : IOEvent(IOType::TCP_SERVER), msg_type_(msg_type), tcp_evt_cbs_(tcp_evt_cbs)
+// an fd kept open for the accepting when the process runs out of fds, see DropClient()
+static int OpenReserveFd()
 {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+// out of fds the listener stays readable, and a level-triggered loop would spin on it. the
+// reserved fd is freed to accept a connection of the backlog and close it at once, then it is
+// taken again. returns false if no connection is dropped.
+static bool DropClient(int listen_fd, int& reserve_fd)
+{
+    if (reserve_fd < 0) return false;
+    close(reserve_fd);
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0) close(fd);
+    reserve_fd = OpenReserveFd();
+    return fd >= 0;
+}
+
+TcpServer::TcpServer(const char *host, uint16_t port, MessageType msg_type, TcpCallbacksPtr tcp_evt_cbs, EventLoop* el)
+    : IOEvent(IOType::TCP_SERVER, -1, FileEvent::READ | FileEvent::ERROR, el), msg_type_(msg_type), loop_group_(NULL), completion_mode_(false), edge_triggered_(false), incoming_cpu_(false),
+      budget_bytes_(BufferIOEvent::DFT_BUDGET_BYTES), budget_msgs_(BufferIOEvent::DFT_BUDGET_MSGS), accept_batch_(DFT_ACCEPT_BATCH),
+      conn_count_(0), max_conns_(0), max_conns_per_ip_(0), conns_(0), accept_rate_(0), accept_burst_(0), tokens_(0), shed_lag_ns_(0),
+      tcp_evt_cbs_(tcp_evt_cbs)
+{
+    reserve_fd_ = OpenReserveFd();
     InitAddress(host, port);
     Start();
 }
@@ -20,9 +47,26 @@ TcpServer::~TcpServer()
 
 void TcpServer::Destroy()
 {
-    conn_map_.clear();
+    DisableShedding();
+    // the listeners go first, no connection is accepted during the cleanup
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        TcpServerShard* shard = shards_[i];
+        loop_group_->GetThread(i)->PostAndWait([shard] { delete shard; });
+    }
+    shards_.clear();
+    conn_table_.Clear();
+    // the connections are released on their own loops, they are registered there
+    for (size_t i = 0; i < loop_conn_tables_.size(); ++i) {
+        TcpConnTable& conn_table = loop_conn_tables_[i];
+        EventLoopThread* t = loop_group_->GetThread(i);
+        t->PostAndWait([&conn_table] { conn_table.Clear(); });
+    }
+    loop_conn_tables_.clear();
+    conn_count_ = 0;
     close(fd_);
     SetFD(-1);
+    if (reserve_fd_ >= 0) close(reserve_fd_);
+    reserve_fd_ = -1;
 }
 
 void TcpServer::InitAddress(const char* host, uint16_t port)
@@ -41,44 +85,98 @@ void TcpServer::EnableHeartbeat(uint32_t idle_interval, uint32_t ping_interval,
 {
     hb_tmp_params_ = std::make_shared<HeartbeatParams>(idle_interval, ping_interval, ping_total);
 
-    FdTcpConnMap::iterator iter;
-    for (iter = conn_map_.begin(); iter != conn_map_.end(); ++iter) {
-        iter->second->EnableHeartbeat(idle_interval, ping_interval, ping_total);
-    }
+    ForEachConnection([=](const TcpConnectionPtr& conn) {
+        conn->EnableHeartbeat(idle_interval, ping_interval, ping_total);
+    });
 }
 
 void TcpServer::EnableIdleTimeout(uint32_t seconds, const OnIdleTimeoutCallback& cb)
 {
     idle_timeout_params_ = std::make_shared<IdleTimeoutParams>(std::make_tuple(seconds, cb));
 
-    FdTcpConnMap::iterator iter;
-    for (iter = conn_map_.begin(); iter != conn_map_.end(); ++iter) {
-        iter->second->EnableIdleTimeout(seconds, cb);
-    }
+    ForEachConnection([=](const TcpConnectionPtr& conn) {
+        conn->EnableIdleTimeout(seconds, cb);
+    });
 }
 
 void TcpServer::SetTcpCallbacks(const TcpCallbacksPtr& tcp_evt_cbs)
 {
     tcp_evt_cbs_ = tcp_evt_cbs;
 
-    FdTcpConnMap::iterator iter;
-    for (iter = conn_map_.begin(); iter != conn_map_.end(); ++iter) {
-        iter->second->SetTcpCallbacks(tcp_evt_cbs_);
-    }
+    ForEachConnection([tcp_evt_cbs](const TcpConnectionPtr& conn) {
+        conn->SetTcpCallbacks(tcp_evt_cbs);
+    });
 }
 
 TcpConnectionPtr TcpServer::GetConnectionByFD(int fd)
 {
-    FdTcpConnMap::iterator iter = conn_map_.find(fd);
-    return (iter != conn_map_.end() ? iter->second : nullptr);
+    TcpConnectionPtr* conn = LocalConnTable().Find(fd);
+    return conn ? *conn : nullptr;
+}
+
+uint32_t TcpServer::GetConnectionNumber() const
+{
+    return conn_count_.load(std::memory_order_relaxed);
+}
+
+void TcpServer::SetEventLoopGroup(EventLoopGroup* loop_group)
+{
+    if (!loop_conn_tables_.empty()) {
+        printf("[TcpServer::SetEventLoopGroup] the connections have been distributed, ignored\n");
+        return;
+    }
+    loop_group_ = loop_group;
+    if (loop_group_) loop_conn_tables_.resize(loop_group_->Size());
+}
+
+void TcpServer::EnableCompletionMode(bool enable)
+{
+    completion_mode_ = enable;
+    if (completion_mode_ && el_ && fd_ >= 0 && el_->EnableCompletion(this, ACCEPT_MULTISHOT) != 0) {
+        printf("[TcpServer::EnableCompletionMode] not supported by the poller, accepting on READ events\n");
+    }
+    for (size_t i = 0; completion_mode_ && i < shards_.size(); ++i) {
+        TcpServerShard* shard = shards_[i];
+        EventLoopThread* t = loop_group_->GetThread(i);
+        t->Post([shard, t] { t->GetLoop()->EnableCompletion(shard, ACCEPT_MULTISHOT); });
+    }
+}
+
+TcpConnTable& TcpServer::LocalConnTable()
+{
+    EventLoopThread* t = EventLoopThread::Current();
+    if (loop_group_ && loop_group_->Contains(t) && t->Index() < loop_conn_tables_.size()) {
+        return loop_conn_tables_[t->Index()];
+    }
+    return conn_table_;
+}
+
+void TcpServer::ForEachConnection(const std::function<void (const TcpConnectionPtr&)>& fn)
+{
+    conn_table_.ForEach([&fn](int fd, const TcpConnectionPtr& conn) { fn(conn); });
+    for (size_t i = 0; i < loop_conn_tables_.size(); ++i) {
+        TcpConnTable* conn_table = &loop_conn_tables_[i];
+        loop_group_->GetThread(i)->Post([conn_table, fn] {
+            conn_table->ForEach([&fn](int fd, const TcpConnectionPtr& conn) { fn(conn); });
+        });
+    }
 }
 
 bool TcpServer::Start()
+{
+    int fd = CreateListener(false);
+    if (fd < 0) return false;
+    SetFD(fd);
+
+    return true;
+}
+
+int TcpServer::CreateListener(bool reuse_port)
 {
     int fd = -1;
     if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
         OnError(errno, strerror(errno));
-        return false;
+        return -1;
     }
 
     int reuseaddr = 1;
@@ -86,9 +184,19 @@ bool TcpServer::Start()
     {
         OnError(errno, strerror(errno));
         close(fd);
-        return false;
+        return -1;
     }
 
+#if defined(SO_REUSEPORT)
+    int reuseport = 1;
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) == -1)
+    {
+        OnError(errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+#endif
+
     int qlen = 5;
     if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
     {
@@ -101,45 +209,390 @@ bool TcpServer::Start()
     sock_addr.sin_port = htons(server_addr_.port_);
     if (inet_aton(server_addr_.ip_.c_str(), &sock_addr.sin_addr) == 0) {
         OnError(errno, strerror(errno));
-        return false;
+        close(fd);
+        return -1;
     }
 
     if (bind(fd, (sockaddr*)&sock_addr, sizeof(sockaddr_in)) == -1 || listen(fd, 4096) == -1) {
         OnError(errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool TcpServer::EnableReusePort(bool steer_by_cpu)
+{
+#if defined(SO_REUSEPORT)
+    if (!shards_.empty()) return true;
+    if (!loop_group_ || loop_group_->Size() == 0) {
+        printf("[TcpServer::EnableReusePort] no event loop group, keep the single listener\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < loop_group_->Size(); ++i) {
+        if (!loop_group_->GetThread(i)->IsRunning()) {
+            printf("[TcpServer::EnableReusePort] loop thread %u is not running, keep the single listener\n", i);
+            return false;
+        }
+    }
+
+    // the probes of the shedding point at the single listener, they are set up again for the shards
+    int64_t shed_lag_ns = shed_lag_ns_;
+    DisableShedding();
+
+    // the single listener has no SO_REUSEPORT, the address is taken until it is closed
+    int listen_fd = fd_;
+    SetFD(-1);
+    close(listen_fd);
+
+    // the listeners join the reuseport group in order, so the index of a listener in the
+    // group is the index of its loop, the CBPF program relies on it
+    for (uint32_t i = 0; i < loop_group_->Size(); ++i) {
+        EventLoopThread* t = loop_group_->GetThread(i);
+        int fd = CreateListener(true);
+        if (fd < 0) break;
+        t->PostAndWait([this, fd, t] { shards_.push_back(new TcpServerShard(this, fd, t)); });
+    }
+    if (shards_.size() < loop_group_->Size()) {
+        printf("[TcpServer::EnableReusePort] create listeners failed, back to the single listener\n");
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            TcpServerShard* shard = shards_[i];
+            loop_group_->GetThread(i)->PostAndWait([shard] { delete shard; });
+        }
+        shards_.clear();
+        Start();
+        if (completion_mode_) EnableCompletionMode();
+        if (shed_lag_ns > 0) EnableShedding(TimeVal::FromNs(shed_lag_ns), shed_interval_);
         return false;
     }
-    SetFD(fd);
 
+    if (steer_by_cpu) AttachCpuSteering(shards_[0]->FD());
+    if (shed_lag_ns > 0) EnableShedding(TimeVal::FromNs(shed_lag_ns), shed_interval_);
     return true;
+#else
+    printf("[TcpServer::EnableReusePort] SO_REUSEPORT is not supported\n");
+    return false;
+#endif
+}
+
+void TcpServer::AttachCpuSteering(int listen_fd)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    // returns the index of the listener whose loop is pinned to the cpu receiving the
+    // connection, or the cpu modulo the listeners for the cpus without a loop
+    std::vector<struct sock_filter> code;
+    struct sock_filter load_cpu = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    code.push_back(load_cpu);
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        int cpu = loop_group_->GetThread(i)->Cpu();
+        if (cpu < 0) continue;
+        struct sock_filter match = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpu, 0, 1);
+        struct sock_filter ret = BPF_STMT(BPF_RET | BPF_K, (uint32_t)i);
+        code.push_back(match);
+        code.push_back(ret);
+    }
+    struct sock_filter mod = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)shards_.size());
+    struct sock_filter ret = BPF_STMT(BPF_RET | BPF_A, 0);
+    code.push_back(mod);
+    code.push_back(ret);
+
+    struct sock_fprog prog;
+    prog.len = code.size();
+    prog.filter = &code[0];
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        printf("[TcpServer::AttachCpuSteering] attach CBPF failed, listeners are selected by hash: %s(errno: %d)\n",
+                strerror(errno), errno);
+    }
+#else
+    printf("[TcpServer::AttachCpuSteering] SO_ATTACH_REUSEPORT_CBPF is not supported, listeners are selected by hash\n");
+#endif
 }
 
 void TcpServer::OnEvents(uint32_t events)
 {
     if (events & FileEvent::READ) {
+        AcceptClients(fd_, accept_stats_, NULL);
+    }
+
+    if (events & FileEvent::ERROR) {
+        OnError(errno, strerror(errno));
+    }
+}
+
+void TcpServer::AcceptClients(int listen_fd, AcceptStats& stats, TcpServerShard* shard)
+{
+    stats.wakeups++;
+    int& reserve_fd = shard ? shard->reserve_fd_ : reserve_fd_;
+    uint32_t accepted = 0;
+    uint32_t dropped = 0;
+    while (accepted + dropped < accept_batch_) {
         IPAddress peer_addr;
-        int fd = AcceptClient(peer_addr);
-        if (fd > 0) {
-            OnNewClient(fd, peer_addr);
+        int fd = AcceptClient(listen_fd, peer_addr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            int err = errno;
+            stats.errors++;
+            if (dropped == 0) OnError(err, strerror(err));
+            if ((err == EMFILE || err == ENFILE) && DropClient(listen_fd, reserve_fd)) {
+                dropped++;
+                continue;
+            }
+            break;
+        }
+        accepted++;
+        OnAccepted(fd, peer_addr, stats, shard);
+    }
+
+    stats.accepted += accepted;
+    if (accepted > stats.max_batch) stats.max_batch = accepted;
+    if (accepted == accept_batch_) stats.full_batches++;
+}
+
+void TcpServer::GetAcceptStats(AcceptStats& stats)
+{
+    stats = accept_stats_;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        TcpServerShard* shard = shards_[i];
+        AcceptStats shard_stats;
+        loop_group_->GetThread(i)->PostAndWait([shard, &shard_stats] { shard_stats = shard->accept_stats_; });
+        stats.Merge(shard_stats);
+    }
+}
+
+void TcpServer::OnAccepted(int fd, const IPAddress& peer_addr, AcceptStats& stats, TcpServerShard* shard)
+{
+    if (!Admit(peer_addr, stats)) {
+        close(fd);
+        return;
+    }
+    if (shard) {
+        shard->OnNewClient(fd, peer_addr);
+    } else {
+        OnNewClient(fd, peer_addr);
+    }
+}
+
+bool TcpServer::Admit(const IPAddress& peer_addr, AcceptStats& stats)
+{
+    // the listeners of the shards admit concurrently, so the count is reserved first
+    uint32_t conns = conns_.load();
+    do {
+        if (max_conns_ > 0 && conns >= max_conns_) {
+            stats.rejected[AcceptStats::MAX_CONNECTIONS]++;
+            return false;
+        }
+    } while (!conns_.compare_exchange_weak(conns, conns + 1));
+
+    if (accept_rate_ > 0 || max_conns_per_ip_ > 0) {
+        std::lock_guard<std::mutex> lock(admission_mutex_);
+        if (accept_rate_ > 0) {
+            TimeVal now = TimeVal::MonoNow();
+            tokens_ += TimeVal::NsDiff(now, tokens_time_) / 1e9 * accept_rate_;
+            if (tokens_ > accept_burst_) tokens_ = accept_burst_;
+            tokens_time_ = now;
+            if (tokens_ < 1.0) {
+                stats.rejected[AcceptStats::ACCEPT_RATE]++;
+                conns_--;
+                return false;
+            }
+        }
+        if (max_conns_per_ip_ > 0) {
+            uint32_t& ip_conns = ip_conns_[peer_addr.ip_];
+            if (ip_conns >= max_conns_per_ip_) {
+                stats.rejected[AcceptStats::MAX_PER_IP]++;
+                conns_--;
+                return false;
+            }
+            ip_conns++;
+        }
+        if (accept_rate_ > 0) tokens_ -= 1.0;
+    }
+    return true;
+}
+
+void TcpServer::ReleaseAdmission(const IPAddress& peer_addr)
+{
+    conns_--;
+    if (max_conns_per_ip_ == 0) return;
+    std::lock_guard<std::mutex> lock(admission_mutex_);
+    // the connections admitted before the limit was set are not counted
+    auto iter = ip_conns_.find(peer_addr.ip_);
+    if (iter != ip_conns_.end() && --iter->second == 0) {
+        ip_conns_.erase(iter);
+    }
+}
+
+void TcpServer::SetAcceptRate(uint32_t rate, uint32_t burst)
+{
+    std::lock_guard<std::mutex> lock(admission_mutex_);
+    accept_rate_ = rate;
+    accept_burst_ = burst > 0 ? burst : 1;
+    tokens_ = accept_burst_;
+    tokens_time_ = TimeVal::MonoNow();
+}
+
+// measures the lag of a loop by how late its timer is processed
+struct TcpServer::LagProbe {
+    EventLoopThread*    thread;     // NULL for the loop of the server
+    PeriodicTimer*      timer;
+    IOEvent*            listener;   // the listener to pause on the loop, NULL if none
+    AcceptStats*        stats;      // of the listener
+    std::atomic<int64_t> lag_ns;
+    bool                paused;
+    TimeVal             paused_time;
+
+    LagProbe(EventLoopThread* t, IOEvent* l, AcceptStats* s) :
+        thread(t), timer(NULL), listener(l), stats(s), lag_ns(0), paused(false) { }
+};
+
+void TcpServer::EnableShedding(const TimeVal& max_lag, const TimeVal& interval)
+{
+    DisableShedding();
+    shed_lag_ns_ = max_lag.Nanoseconds();
+    shed_interval_ = interval;
+
+    if (!shards_.empty()) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            lag_probes_.push_back(std::make_shared<LagProbe>(loop_group_->GetThread(i), shards_[i], &shards_[i]->accept_stats_));
+        }
+    } else {
+        lag_probes_.push_back(std::make_shared<LagProbe>((EventLoopThread*)NULL, this, &accept_stats_));
+        for (uint32_t i = 0; loop_group_ && i < loop_group_->Size(); ++i) {
+            lag_probes_.push_back(std::make_shared<LagProbe>(loop_group_->GetThread(i), (IOEvent*)NULL, (AcceptStats*)NULL));
+        }
+    }
+
+    for (size_t i = 0; i < lag_probes_.size(); ++i) {
+        LagProbe* probe = lag_probes_[i].get();
+        auto start = [this, probe, interval] {
+            EventLoop* el = probe->thread ? probe->thread->GetLoop() : Loop();
+            probe->timer = new PeriodicTimer(interval, std::bind(&TcpServer::OnLagProbe, this, probe), el);
+            probe->timer->SetName("TcpServer::LagProbe");
+            probe->timer->Start();
+        };
+        if (probe->thread) {
+            probe->thread->PostAndWait(start);
         } else {
-            events |= FileEvent::ERROR;
+            start();
         }
     }
+}
 
-    if (events & FileEvent::ERROR) {
-        OnError(errno, strerror(errno));
+void TcpServer::DisableShedding()
+{
+    for (size_t i = 0; i < lag_probes_.size(); ++i) {
+        LagProbe* probe = lag_probes_[i].get();
+        auto stop = [probe] {
+            delete probe->timer;    // stopped by the destructor
+            if (probe->paused) probe->listener->AddReadEvent();
+        };
+        if (probe->thread) {
+            probe->thread->PostAndWait(stop);
+        } else {
+            stop();
+        }
     }
+    lag_probes_.clear();
+    shed_lag_ns_ = 0;
 }
 
-int TcpServer::AcceptClient(IPAddress& peer_addr)
+void TcpServer::OnLagProbe(LagProbe* probe)
 {
-    struct sockaddr_in sock_addr;
-    uint32_t size = sizeof(sock_addr);
+    EventLoop* el = probe->timer->GetLoop();
+    int64_t lag = TimeVal::NsDiff(el->Now(), probe->timer->Time());
+    probe->lag_ns.store(lag, std::memory_order_relaxed);
+    if (!probe->listener) return;
+
+    // the single listener feeds all the loops, it follows the busiest one
+    if (shards_.empty()) {
+        for (size_t i = 0; i < lag_probes_.size(); ++i) {
+            int64_t loop_lag = lag_probes_[i]->lag_ns.load(std::memory_order_relaxed);
+            if (loop_lag > lag) lag = loop_lag;
+        }
+    }
 
-    int fd = accept(fd_, (struct sockaddr*)&sock_addr, &size);
-    if (fd < 0) {
-        OnError(errno, strerror(errno));
-        return -1;
+    if (!probe->paused && lag > shed_lag_ns_) {
+        printf("[TcpServer::OnLagProbe] loop lag %.3fms, stop accepting\n", lag / 1e6);
+        probe->listener->DeleteReadEvent();
+        probe->paused = true;
+        probe->paused_time = el->Now();
+        probe->stats->shed_pauses++;
+    } else if (probe->paused && lag < shed_lag_ns_ / 2) {
+        printf("[TcpServer::OnLagProbe] loop lag %.3fms, resume accepting\n", lag / 1e6);
+        probe->listener->AddReadEvent();
+        probe->paused = false;
+        probe->stats->shed_ns += TimeVal::NsDiff(el->Now(), probe->paused_time);
+    }
+}
+
+void AcceptStats::Reset()
+{
+    accepted = wakeups = full_batches = errors = 0;
+    max_batch = 0;
+    for (int i = 0; i < REJECT_REASONS; ++i) {
+        rejected[i] = 0;
     }
+    shed_pauses = shed_ns = 0;
+}
+
+void AcceptStats::Merge(const AcceptStats& other)
+{
+    accepted += other.accepted;
+    wakeups += other.wakeups;
+    full_batches += other.full_batches;
+    errors += other.errors;
+    if (other.max_batch > max_batch) max_batch = other.max_batch;
+    for (int i = 0; i < REJECT_REASONS; ++i) {
+        rejected[i] += other.rejected[i];
+    }
+    shed_pauses += other.shed_pauses;
+    shed_ns += other.shed_ns;
+}
+
+// the peer address of the fd accepted by the poller, multishot accept does not return it
+static void GetPeerAddress(int fd, IPAddress& peer_addr)
+{
+    struct sockaddr_storage sock_addr;
+    socklen_t size = sizeof(sock_addr);
+    if (getpeername(fd, (struct sockaddr*)&sock_addr, &size) == 0) {
+        if (sock_addr.ss_family == AF_INET6) {
+            SocketAddrToIPAddress(*(struct sockaddr_in6*)&sock_addr, peer_addr);
+        } else {
+            SocketAddrToIPAddress(*(struct sockaddr_in*)&sock_addr, peer_addr);
+        }
+    }
+}
+
+void TcpServer::OnCompletion(int res, const char* data)
+{
+    accept_stats_.wakeups++;
+    if (res < 0) {
+        accept_stats_.errors++;
+        OnError(-res, strerror(-res));
+        return;
+    }
+
+    accept_stats_.accepted++;
+    if (accept_stats_.max_batch == 0) accept_stats_.max_batch = 1;
+    IPAddress peer_addr;
+    GetPeerAddress(res, peer_addr);
+    OnAccepted(res, peer_addr, accept_stats_, NULL);
+}
+
+int TcpServer::AcceptClient(int listen_fd, IPAddress& peer_addr)
+{
+    struct sockaddr_in sock_addr;
+    socklen_t size = sizeof(sock_addr);
+
+#if defined(__linux__)
+    // non-blocking already, EventLoop::AddEvent() does not change the flags then
+    int fd = accept4(listen_fd, (struct sockaddr*)&sock_addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd = accept(listen_fd, (struct sockaddr*)&sock_addr, &size);
+#endif
+    if (fd < 0) return -1;
     SocketAddrToIPAddress(sock_addr, peer_addr);
 
     return fd;
@@ -148,22 +601,75 @@ int TcpServer::AcceptClient(IPAddress& peer_addr)
 void TcpServer::OnNewClient(int fd, const IPAddress& peer_addr)
 {
     printf("[TcpServer::OnNewClient] new connection, fd: %d\n", fd);
+    EventLoopThread* t = SelectLoop(fd);
+    if (t) {
+        // the connection is created on its owning loop, so its events and timers are registered there
+        t->IncLoad();
+        if (!t->Post(std::bind(&TcpServer::SetupConnection, this, fd, peer_addr))) {
+            t->DecLoad();   // the loop exited after it was selected
+            ReleaseAdmission(peer_addr);
+            close(fd);
+        }
+    } else {
+        SetupConnection(fd, peer_addr);
+    }
+}
+
+EventLoopThread* TcpServer::SelectLoop(int fd)
+{
+    if (!loop_group_) return NULL;
+    EventLoopThread* t = NULL;
+#if defined(SO_INCOMING_CPU)
+    if (incoming_cpu_) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+            t = loop_group_->ForCpu(cpu);
+        }
+    }
+#endif
+    return t ? t : loop_group_->Next();
+}
+
+void TcpServer::SetupConnection(int fd, const IPAddress& peer_addr)
+{
     TcpConnectionPtr conn = CreateClient(fd, server_addr_, peer_addr, peer_addr);
     conn->SetMessageType(msg_type_);
+    if (name_) conn->SetName(name_);   // the callbacks of the connection are profiled as the server
     if (hb_tmp_params_) {
         conn->EnableHeartbeat(hb_tmp_params_->idle_interval, hb_tmp_params_->ping_interval, hb_tmp_params_->ping_total);
     }
     if (idle_timeout_params_) {
         conn->EnableIdleTimeout(std::get<0>(*idle_timeout_params_), std::get<1>(*idle_timeout_params_));
     }
-    conn_map_.insert(std::make_pair(fd, conn));
+    conn->SetIOBudget(budget_bytes_, budget_msgs_);
+    if (edge_triggered_) conn->SetEdgeTriggered(true);
+    if (completion_mode_) conn->EnableCompletionMode();
+    TcpConnTable& conn_table = LocalConnTable();
+    if (!conn_table.Insert(fd, conn)) {
+        // the connection is released on return, it is not handed to the callback
+        printf("[TcpServer::SetupConnection] fd %d is in the connection table already\n", fd);
+        ReleaseAdmission(peer_addr);
+        if (&conn_table != &conn_table_) EventLoopThread::Current()->DecLoad();
+        return;
+    }
+    conn_count_++;
     if (new_client_cb_) new_client_cb_(conn.get());
 }
 
 void TcpServer::OnConnectionClosed(TcpConnection* conn)
 {
     printf("[TcpServer::OnConnectionClosed] Erase connection, fd: %d\n", conn->FD());
-    conn_map_.erase(conn->FD());
+    TcpConnTable& conn_table = LocalConnTable();
+    TcpConnectionPtr* conn_ptr = conn_table.Find(conn->FD());
+    // it is still running the callback, released by the loop after the handlers return
+    if (conn_ptr) conn->GetLoop()->DeferRelease(*conn_ptr);
+    IPAddress peer_addr = conn->GetPeerAddr();
+    if (conn_table.Erase(conn->FD())) {
+        conn_count_--;
+        ReleaseAdmission(peer_addr);
+        if (&conn_table != &conn_table_) EventLoopThread::Current()->DecLoad();
+    }
 }
 
 void TcpServer::OnError(int errcode, const char* errstr)
@@ -178,8 +684,60 @@ void TcpServer::OnError(int errcode, const char* errstr)
 
 //////////////////////////////////////////////
 
-TcpServer6::TcpServer6(const char *host, uint16_t port, bool ipv6_only, MessageType msg_type, TcpCallbacksPtr tcp_evt_cbs)
-    : TcpServer(host, port, msg_type, tcp_evt_cbs),
+TcpServerShard::TcpServerShard(TcpServer* server, int fd, EventLoopThread* thread)
+    : IOEvent(IOType::TCP_SERVER, fd, FileEvent::READ | FileEvent::ERROR, thread->GetLoop()),
+    server_(server), thread_(thread), reserve_fd_(OpenReserveFd())
+{
+    if (server_->name_) SetName(server_->name_);
+    if (server_->completion_mode_ && thread_->GetLoop()->EnableCompletion(this, ACCEPT_MULTISHOT) != 0) {
+        printf("[TcpServerShard::TcpServerShard] not supported by the poller, accepting on READ events\n");
+    }
+}
+
+TcpServerShard::~TcpServerShard()
+{
+    if (reserve_fd_ >= 0) close(reserve_fd_);
+}
+
+void TcpServerShard::OnEvents(uint32_t events)
+{
+    if (events & FileEvent::READ) {
+        server_->AcceptClients(fd_, accept_stats_, this);
+    }
+
+    if (events & FileEvent::ERROR) {
+        server_->OnError(errno, strerror(errno));
+    }
+}
+
+void TcpServerShard::OnCompletion(int res, const char* data)
+{
+    accept_stats_.wakeups++;
+    if (res < 0) {
+        accept_stats_.errors++;
+        server_->OnError(-res, strerror(-res));
+        return;
+    }
+
+    accept_stats_.accepted++;
+    if (accept_stats_.max_batch == 0) accept_stats_.max_batch = 1;
+    IPAddress peer_addr;
+    GetPeerAddress(res, peer_addr);
+    server_->OnAccepted(res, peer_addr, accept_stats_, this);
+}
+
+void TcpServerShard::OnNewClient(int fd, const IPAddress& peer_addr)
+{
+    printf("[TcpServerShard::OnNewClient] new connection on loop thread %u, fd: %d\n", thread_->Index(), fd);
+    // accepted on the owning loop already, no handoff
+    thread_->IncLoad();
+    server_->SetupConnection(fd, peer_addr);
+}
+
+//////////////////////////////////////////////
+
+TcpServer6::TcpServer6(const char *host, uint16_t port, bool ipv6_only, MessageType msg_type, TcpCallbacksPtr tcp_evt_cbs, EventLoop* el)
+    : TcpServer(host, port, msg_type, tcp_evt_cbs, el),
     ipv6_only_(ipv6_only)
 {
     InitAddress(host, port);
@@ -201,12 +759,12 @@ void TcpServer6::InitAddress(const char* host, uint16_t port)
     }
 }
 
-bool TcpServer6::Start()
+int TcpServer6::CreateListener(bool reuse_port)
 {
     int fd = -1;
     if ((fd = socket(PF_INET6, SOCK_STREAM, 0)) == -1) {
         OnError(errno, strerror(errno));
-        return false;
+        return -1;
     }
 
     int reuseaddr = 1;
@@ -214,9 +772,19 @@ bool TcpServer6::Start()
     {
         OnError(errno, strerror(errno));
         close(fd);
-        return false;
+        return -1;
     }
 
+#if defined(SO_REUSEPORT)
+    int reuseport = 1;
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) == -1)
+    {
+        OnError(errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+#endif
+
     int qlen = 5;
     if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
     {
@@ -229,36 +797,40 @@ bool TcpServer6::Start()
     sock_addr.sin6_port = htons(server_addr_.port_);
     if (inet_pton(AF_INET6, server_addr_.ip_.c_str(), &sock_addr.sin6_addr) == 0) {
         OnError(errno, strerror(errno));
-        return false;
+        close(fd);
+        return -1;
     }
 
     if (ipv6_only_) {
         int on = 1;
         if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == -1) {
             OnError(errno, strerror(errno));
-            return false;
+            close(fd);
+            return -1;
         }
     }
 
     if (bind(fd, (struct sockaddr*)&sock_addr, sizeof(sock_addr)) == -1 || listen(fd, 4096) == -1) {
         OnError(errno, strerror(errno));
-        return false;
+        close(fd);
+        return -1;
     }
-    SetFD(fd);
 
-    return true;
+    return fd;
 }
 
-int TcpServer6::AcceptClient(IPAddress& peer_addr)
+int TcpServer6::AcceptClient(int listen_fd, IPAddress& peer_addr)
 {
     struct sockaddr_in6 sock_addr;
-    uint32_t size = sizeof(sock_addr);
-
-    int fd = accept(fd_, (struct sockaddr*)&sock_addr, &size);
-    if (fd < 0) {
-        OnError(errno, strerror(errno));
-        return -1;
-    }
+    socklen_t size = sizeof(sock_addr);
+
+#if defined(__linux__)
+    // non-blocking already, EventLoop::AddEvent() does not change the flags then
+    int fd = accept4(listen_fd, (struct sockaddr*)&sock_addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd = accept(listen_fd, (struct sockaddr*)&sock_addr, &size);
+#endif
+    if (fd < 0) return -1;
     SocketAddrToIPAddress(sock_addr, peer_addr);
 
     return fd;
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "timer_handler.h"
 #include "eventloop.h"
 
@@ -5,15 +6,13 @@ namespace evt_loop
 {
 
 // TimerEvent implementation
-TimerEvent::TimerEvent() :
-  IEvent(IEvent::NONE), running_(false)
+TimerEvent::TimerEvent(EventLoop* el) :
+  IEvent(IEvent::NONE, el ? el : EventLoop::Current()), running_(false), link_(this), expire_tick_(0)
 {
-  el_ = EV_Singleton;
 }
-TimerEvent::TimerEvent(const TimeVal& inter) :
-  IEvent(IEvent::NONE), interval_(inter), running_(false)
+TimerEvent::TimerEvent(const TimeVal& inter, EventLoop* el) :
+  IEvent(IEvent::NONE, el ? el : EventLoop::Current()), interval_(inter), running_(false), link_(this), expire_tick_(0)
 {
-  el_ = EV_Singleton;
 }
 
 void TimerEvent::OnEvents(uint32_t events) {
@@ -44,9 +43,9 @@ void TimerEvent::Stop() {
   el_->DeleteEvent(this);
 }
 
-// TimerManager implementation
-int TimerManager::AddEvent(TimerEvent *e) {
-  //printf("[TimerManager::AddEvent] event object: %p, timeval: (%ld.%ld)\n", e, e->Time().tv_sec, e->Time().tv_usec);
+// TimerMapManager implementation
+int TimerMapManager::AddEvent(TimerEvent *e) {
+  //printf("[TimerMapManager::AddEvent] event object: %p, timeval: (%ld.%ld)\n", e, e->Time().tv_sec, e->Time().tv_usec);
   TimerMap::iterator iter = timers_.find(e->Time());
   if (iter != timers_.end()) {
       iter->second.insert(e);
@@ -58,7 +57,7 @@ int TimerManager::AddEvent(TimerEvent *e) {
   return 0;
 }
 
-int TimerManager::DeleteEvent(TimerEvent *e) {
+int TimerMapManager::DeleteEvent(TimerEvent *e) {
   TimerMap::iterator iter = timers_.find(e->Time());
   if (iter != timers_.end()) {
       iter->second.erase(e);
@@ -66,7 +65,7 @@ int TimerManager::DeleteEvent(TimerEvent *e) {
   return 0;
 }
 
-int TimerManager::UpdateEvent(TimerEvent *e) {
+int TimerMapManager::UpdateEvent(TimerEvent *e) {
   TimerMap::iterator iter = timers_.find(e->Time());
   if (iter != timers_.end()) {
       iter->second.erase(e);
@@ -79,4 +78,247 @@ int TimerManager::UpdateEvent(TimerEvent *e) {
   return 0;
 }
 
+int TimerMapManager::ProcessTimeout(const TimeVal& now) {
+  int n = 0;
+  TimerMap::iterator iter = timers_.begin();
+  while (iter != timers_.end()) {
+    TimeVal tv = iter->first;
+    if (now < tv) break;
+    n++;
+    TimerSet events_set = iter->second;
+    TimerSet::iterator iter2;
+    for (iter2 = events_set.begin(); iter2 != events_set.end(); ++iter2) {
+      TimerEvent *e = *iter2;
+      CallbackProfiler::Scope scope(e->el_->ActiveProfiler(), e);
+      e->OnEvents(TimerEvent::TIMER);
+    }
+    timers_.erase(iter);
+    iter = timers_.begin();
+  }
+  return n;
+}
+
+bool TimerMapManager::NextExpiration(TimeVal& expires) {
+  if (timers_.empty()) return false;
+  expires = timers_.begin()->first;
+  return true;
+}
+
+// TimerWheelManager implementation
+static inline void ListInit(TimerLink* head) {
+  head->prev = head->next = head;
+}
+
+static inline bool ListEmpty(const TimerLink* head) {
+  return head->next == head;
+}
+
+static inline void ListAppend(TimerLink* head, TimerLink* node) {
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static inline void ListUnlink(TimerLink* node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = node->next = NULL;
+}
+
+// moves all nodes of 'from' to the empty list 'to'
+static inline void ListSplice(TimerLink* from, TimerLink* to) {
+  if (ListEmpty(from)) {
+    ListInit(to);
+    return;
+  }
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  ListInit(from);
+}
+
+TimerWheelManager::TimerWheelManager(const TimeVal& now) :
+  current_tick_(ToTick(now)), count_(0)
+{
+  for (uint32_t i = 0; i < ROOT_SIZE; i++) {
+    ListInit(&root_[i]);
+  }
+  for (uint32_t l = 0; l < LEVELS; l++) {
+    for (uint32_t i = 0; i < LEVEL_SIZE; i++) {
+      ListInit(&levels_[l][i]);
+    }
+  }
+  memset(root_bitmap_, 0, sizeof(root_bitmap_));
+}
+
+TimerWheelManager::~TimerWheelManager() {
+  // detaches the timers still linked, so that they won't touch the freed slots
+  for (uint32_t i = 0; i < ROOT_SIZE; i++) {
+    while (!ListEmpty(&root_[i])) ListUnlink(root_[i].next);
+  }
+  for (uint32_t l = 0; l < LEVELS; l++) {
+    for (uint32_t i = 0; i < LEVEL_SIZE; i++) {
+      while (!ListEmpty(&levels_[l][i])) ListUnlink(levels_[l][i].next);
+    }
+  }
+}
+
+void TimerWheelManager::Link(TimerEvent *e) {
+  uint64_t expires = e->expire_tick_;
+  if (expires < current_tick_) expires = current_tick_;  // already expired, fires on next tick
+  uint64_t delta = expires - current_tick_;
+
+  TimerLink* slot = NULL;
+  if (delta < ROOT_SIZE) {
+    uint32_t index = expires & ROOT_MASK;
+    slot = &root_[index];
+    MarkRoot(index);
+  } else {
+    const uint64_t max_delta = (1ULL << (ROOT_BITS + LEVELS * LEVEL_BITS)) - 1;
+    if (delta > max_delta) {
+      expires = current_tick_ + max_delta;
+      delta = max_delta;
+    }
+    uint32_t level = 0;
+    while (delta >= (1ULL << (ROOT_BITS + (level + 1) * LEVEL_BITS))) level++;
+    uint32_t index = (expires >> (ROOT_BITS + level * LEVEL_BITS)) & LEVEL_MASK;
+    slot = &levels_[level][index];
+  }
+  e->expire_tick_ = expires;
+  ListAppend(slot, &e->link_);
+}
+
+int TimerWheelManager::AddEvent(TimerEvent *e) {
+  if (e->link_.Linked()) DeleteEvent(e);
+  e->expire_tick_ = ToTick(e->Time());
+  Link(e);
+  count_++;
+  return 0;
+}
+
+int TimerWheelManager::DeleteEvent(TimerEvent *e) {
+  if (!e->link_.Linked()) return 0;
+  TimerLink* prev = e->link_.prev;
+  ListUnlink(&e->link_);
+  count_--;
+  // the slot becomes empty when the previous node is its head and nothing else is left
+  if (prev->owner == NULL && ListEmpty(prev) && prev >= root_ && prev < root_ + ROOT_SIZE) {
+    UnmarkRoot(prev - root_);
+  }
+  return 0;
+}
+
+int TimerWheelManager::UpdateEvent(TimerEvent *e) {
+  DeleteEvent(e);
+  return AddEvent(e);
+}
+
+void TimerWheelManager::Cascade(uint32_t level, uint32_t index) {
+  TimerLink list;
+  ListSplice(&levels_[level][index], &list);
+  while (!ListEmpty(&list)) {
+    TimerLink* node = list.next;
+    ListUnlink(node);
+    Link(node->owner);
+  }
+}
+
+int TimerWheelManager::FindRoot(uint32_t from) const {
+  for (uint32_t w = from >> 6; w < ROOT_SIZE / 64; w++) {
+    uint64_t bits = root_bitmap_[w];
+    if (w == (from >> 6)) bits &= ~0ULL << (from & 63);
+    if (bits) return (w << 6) + __builtin_ctzll(bits);
+  }
+  return -1;
+}
+
+// fires the timers in the root slot, only those expired at 'now' if exact, the others are linked again
+void TimerWheelManager::FireSlot(uint32_t index, const TimeVal& now, bool exact, int& n) {
+  TimerLink expired;
+  ListSplice(&root_[index], &expired);
+  UnmarkRoot(index);
+  while (!ListEmpty(&expired)) {
+    TimerEvent* e = expired.next->owner;
+    ListUnlink(&e->link_);
+    if ((exact || e->expire_tick_ != ToTick(e->Time())) && now < e->Time()) {
+      // not yet, or clamped to the range of the wheel
+      e->expire_tick_ = ToTick(e->Time());
+      Link(e);
+      continue;
+    }
+    count_--;
+    n++;
+    CallbackProfiler::Scope scope(e->el_->ActiveProfiler(), e);
+    e->OnEvents(TimerEvent::TIMER);
+  }
+}
+
+int TimerWheelManager::ProcessTimeout(const TimeVal& now) {
+  uint64_t target = ToTick(now);
+  if (count_ == 0) {
+    if (current_tick_ < target) current_tick_ = target;
+    return 0;
+  }
+
+  int n = 0;
+  while (current_tick_ <= target) {
+    uint32_t index = current_tick_ & ROOT_MASK;
+    if (index == 0) {
+      for (uint32_t l = 0; l < LEVELS; l++) {
+        uint32_t lindex = (current_tick_ >> (ROOT_BITS + l * LEVEL_BITS)) & LEVEL_MASK;
+        Cascade(l, lindex);
+        if (lindex != 0) break;
+      }
+    }
+
+    // nothing left in this round of the root wheel, jumps to the next cascading point
+    int next = FindRoot(index);
+    uint64_t expires = (next >= 0) ? current_tick_ + (next - index) : (current_tick_ | ROOT_MASK) + 1;
+    if (expires > target) {
+      current_tick_ = target;
+      break;
+    }
+    if (next < 0) {
+      current_tick_ = expires;
+      continue;
+    }
+
+    if (expires < target) {
+      // the whole tick is passed. moves to the next tick before firing,
+      // so the timers rearmed in callbacks never land in this slot
+      current_tick_ = expires + 1;
+      FireSlot(next, now, false, n);
+    } else {
+      // the current tick, it stays current until the time passes it
+      current_tick_ = target;
+      FireSlot(next, now, true, n);
+      break;
+    }
+  }
+  return n;
+}
+
+bool TimerWheelManager::NextExpiration(TimeVal& expires) {
+  if (count_ == 0) return false;
+
+  uint32_t index = current_tick_ & ROOT_MASK;
+  int next = FindRoot(index);
+  if (next < 0) {
+    // wakes up at the next cascading point
+    expires = TimeVal::FromNs((int64_t)((current_tick_ | ROOT_MASK) + 1) * NS_PER_TICK);
+    return true;
+  }
+
+  // the earliest timer in the slot, the slot holds the timers of 1 tick only
+  TimerLink* head = &root_[next];
+  TimerLink* node = head->next;
+  expires = node->owner->Time();
+  for (node = node->next; node != head; node = node->next) {
+    if (node->owner->Time() < expires) expires = node->owner->Time();
+  }
+  return true;
+}
+
 }  // namespace evt_loop
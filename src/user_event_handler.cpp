@@ -4,24 +4,23 @@
 namespace evt_loop
 {
 
-UserEvent::UserEvent(const OnUserEventCallback& cb, void* udata, int32_t repeat) :
-  IEvent(IEvent::NONE), id_(0), user_event_cb_(cb), user_data_(udata), repeat_(repeat)
+UserEvent::UserEvent(const OnUserEventCallback& cb, void* udata, int32_t repeat, EventLoop* el) :
+  IEvent(IEvent::NONE, el ? el : EventLoop::Current()), id_(0), user_event_cb_(cb), user_data_(udata), repeat_(repeat)
 {
-  el_ = EV_Singleton;
 }
 
 void UserEvent::OnEvents(uint32_t events) {
   user_event_cb_(this, user_data_);
 }
 
-IdleEvent::IdleEvent(const OnUserEventCallback& cb, void* udata, int32_t repeat) :
-  UserEvent(cb, udata, repeat)
+IdleEvent::IdleEvent(const OnUserEventCallback& cb, void* udata, int32_t repeat, EventLoop* el) :
+  UserEvent(cb, udata, repeat, el)
 {
   el_->AddEvent(this);
 }
 
-TickEvent::TickEvent(const OnUserEventCallback& cb, void* udata, int32_t repeat) :
-  UserEvent(cb, udata, repeat)
+TickEvent::TickEvent(const OnUserEventCallback& cb, void* udata, int32_t repeat, EventLoop* el) :
+  UserEvent(cb, udata, repeat, el)
 {
   el_->AddEvent(this);
 }
@@ -41,8 +40,10 @@ void TickEvent::OnEvents(uint32_t events) {
 uint32_t UserEventManager::Process()
 {
   uint32_t num = 0;
-  for (auto iter = user_events_.begin(); iter != user_events_.end(); ++iter, ++num) {
-    iter->second->OnEvents(1);
+  for (auto iter = user_events_.begin(); iter != user_events_.end(); ++num) {
+    UserEvent* e = (iter++)->second;  // the event may delete itself from the map in its callback
+    CallbackProfiler::Scope scope(e->el_->ActiveProfiler(), e);
+    e->OnEvents(1);
   }
   return num;
 }
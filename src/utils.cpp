@@ -1,70 +1,97 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#endif
 #include "utils.h"
 
 namespace evt_loop {
 
-TimeVal::TimeVal(uint32_t sec, uint32_t usec)
-{
-  tv_.tv_sec = sec;
-  tv_.tv_usec = usec;
-}
+static const int64_t NS_PER_SEC  = 1000000000LL;
+static const int64_t NS_PER_USEC = 1000LL;
+static const int64_t NS_PER_MSEC = 1000000LL;
+
+TimeVal::TimeVal(uint32_t sec, uint32_t usec) :
+  ns_((int64_t)sec * NS_PER_SEC + (int64_t)usec * NS_PER_USEC)
+{ }
 
-TimeVal::TimeVal(const timeval& time) : tv_(time)
+TimeVal::TimeVal(const timeval& time) :
+  ns_((int64_t)time.tv_sec * NS_PER_SEC + (int64_t)time.tv_usec * NS_PER_USEC)
+{ }
+
+TimeVal::TimeVal(const timespec& time) :
+  ns_((int64_t)time.tv_sec * NS_PER_SEC + time.tv_nsec)
 { }
 
 TimeVal& TimeVal::SetNow()
 {
-  gettimeofday(&tv_, NULL);
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ns_ = (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
   return *this;
 }
 
-timeval TimeVal::Value() const{ return tv_; }
-uint32_t TimeVal::Seconds() const { return tv_.tv_sec; }
-uint32_t TimeVal::USeconds() const { return tv_.tv_usec; }
+TimeVal& TimeVal::SetMonoNow()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns_ = (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+  return *this;
+}
+
+timeval TimeVal::Value() const {
+  timeval tv;
+  tv.tv_sec = ns_ / NS_PER_SEC;
+  tv.tv_usec = (ns_ % NS_PER_SEC) / NS_PER_USEC;
+  return tv;
+}
+timespec TimeVal::TimeSpec() const {
+  timespec ts;
+  ts.tv_sec = ns_ / NS_PER_SEC;
+  ts.tv_nsec = ns_ % NS_PER_SEC;
+  return ts;
+}
+uint32_t TimeVal::Seconds() const { return ns_ / NS_PER_SEC; }
+uint32_t TimeVal::USeconds() const { return (ns_ % NS_PER_SEC) / NS_PER_USEC; }
+uint32_t TimeVal::NSeconds() const { return ns_ % NS_PER_SEC; }
 
 bool TimeVal::operator==(const TimeVal& other) const {
-  return tv_.tv_sec == other.Seconds() && tv_.tv_usec == other.USeconds();
+  return ns_ == other.ns_;
 }
 
 bool TimeVal::operator!=(const TimeVal& other) const {
-  return tv_.tv_sec != other.Seconds() || tv_.tv_usec != other.USeconds();
+  return ns_ != other.ns_;
 }
 
 bool TimeVal::operator<(const TimeVal& other) const {
-  return (tv_.tv_sec < other.Seconds()) || (tv_.tv_sec == other.Seconds() && tv_.tv_usec < other.USeconds());
+  return ns_ < other.ns_;
 }
 
 bool TimeVal::operator>(const TimeVal& other) const {
-  return (tv_.tv_sec > other.Seconds()) || (tv_.tv_sec == other.Seconds() && tv_.tv_usec > other.USeconds());
+  return ns_ > other.ns_;
 }
 
 TimeVal TimeVal::operator-(const TimeVal& other) const {
   if (*this < other) return TimeVal(0, 0);
-  uint32_t diff_sec = tv_.tv_usec;
-  uint32_t diff_usec = tv_.tv_usec;
-  if (diff_usec < other.USeconds()) {
-    // 借位
-    diff_sec -= 1;
-    diff_usec += 1000000;
-  }
-  diff_sec -= other.Seconds();
-  diff_usec -= other.USeconds();
-  return TimeVal(diff_sec, diff_usec);
+  return FromNs(ns_ - other.ns_);
 }
 
 TimeVal TimeVal::operator+(const TimeVal& other) const {
-  uint32_t diff_sec = tv_.tv_sec + other.Seconds();      // XXX: integer overflow???
-  uint32_t diff_usec = tv_.tv_usec + other.USeconds();
-  diff_sec += diff_usec / 1000000;
-  diff_usec %= 1000000;
-  //printf("diff_sec: %d, diff_usec: %d\n", diff_sec, diff_usec);
-  return TimeVal(diff_sec, diff_usec);
+  return FromNs(ns_ + other.ns_);
 }
 
 int32_t TimeVal::MsDiff(const TimeVal& lv, const TimeVal& rv) {
-  return (((int64_t)lv.Seconds()) * 1000 + lv.USeconds() / 1000) - (((int64_t)rv.Seconds()) * 1000 + rv.USeconds() / 1000);
+  return lv.ns_ / NS_PER_MSEC - rv.ns_ / NS_PER_MSEC;
 }
 
+TimeVal TimeVal::FromNs(int64_t ns) { TimeVal time; time.ns_ = ns; return time; }
 TimeVal TimeVal::Now() { TimeVal time; return time.SetNow(); }
+TimeVal TimeVal::MonoNow() { TimeVal time; return time.SetMonoNow(); }
 
 void SocketAddrToIPAddress(const struct sockaddr_in& sock_addr, IPAddress& ip_addr)
 {
@@ -82,4 +109,72 @@ void SocketAddrToIPAddress(const struct sockaddr_in6& sock_addr, IPAddress& ip_a
   ip_addr.port_ = sock_addr.sin6_port;
 }
 
+int SetThreadAffinity(int cpu)
+{
+#if defined(__linux__)
+  if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (ret != 0) {
+    printf("[SetThreadAffinity] pin to cpu %d failed: %s(errno: %d)\n", cpu, strerror(ret), ret);
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int NumaNodeOfCpu(int cpu)
+{
+#if defined(__linux__)
+  if (cpu < 0) return -1;
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == NULL) return -1;
+
+  // the cpu directory links to its node as nodeN, there is none without NUMA
+  int node = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int n;
+    if (sscanf(entry->d_name, "node%d", &n) == 1) {
+      node = n;
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+#else
+  return -1;
+#endif
+}
+
+int BindMemoryToNode(void* addr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  static const int MPOL_PREFERRED_ = 1;   // from linux/mempolicy.h, no libnuma needed
+  static const unsigned MPOL_MF_MOVE_ = 1 << 1;
+  static const int MAX_NODES = sizeof(unsigned long) * 8;
+
+  if (addr == NULL || len == 0 || node < 0 || node >= MAX_NODES) return -1;
+  // mbind works on the whole pages
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)addr & ~(page - 1);
+  uintptr_t end = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+
+  unsigned long nodemask = 1UL << node;
+  if (syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED_, &nodemask, MAX_NODES + 1, MPOL_MF_MOVE_) < 0) {
+    printf("[BindMemoryToNode] bind to node %d failed: %s(errno: %d)\n", node, strerror(errno), errno);
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 }  // namespace evt_loop